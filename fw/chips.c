@@ -0,0 +1,88 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "main.h"
+#include "uart.h"
+#include "chips.h"
+
+// Only parts that fit the 17 address lines. 28C EEPROMs have no software ID
+// (theirs needs 12V on A9): they are chosen by name. Not all 28C parts have
+// the chip erase sequence, the CLI blank checks after it.
+static const chip_profile chip_profiles[] PROGMEM = {
+	// name		mfr   dev   size sect page tACC  tWP  tWC   tSE   tCE    flags
+	{ "28C16",	0x00, 0x00, 11, 0,   1, 250, 100, 10000,   0,     0, 0 },
+	{ "28C64",	0x00, 0x00, 13, 0,  32, 250, 100, 10000,   0,    20, CHIP_SDP | CHIP_ERASE },
+	{ "28C256",	0x00, 0x00, 15, 0,  64, 250, 100, 10000,   0,    20, CHIP_SDP | CHIP_ERASE },
+	{ "28C010",	0x00, 0x00, 17, 0, 128, 200, 100, 10000,   0,    20, CHIP_SDP | CHIP_ERASE },
+	{ "AT29C256",	0x1F, 0xDC, 15, 0,  64, 150, 200, 10000,   0,    20, CHIP_ID | CHIP_SDP | CHIP_SECTOR_WRITE | CHIP_ERASE },
+	{ "AT29C512",	0x1F, 0x5D, 16, 0, 128, 150, 200, 10000,   0,    20, CHIP_ID | CHIP_SDP | CHIP_SECTOR_WRITE | CHIP_ERASE },
+	{ "AT29C010A",	0x1F, 0xD5, 17, 0, 128, 150, 200, 10000,   0,    20, CHIP_ID | CHIP_SDP | CHIP_SECTOR_WRITE | CHIP_ERASE },
+	{ "SST29EE010",	0xBF, 0x07, 17, 0, 128, 150, 100, 10000,   0,    20, CHIP_ID | CHIP_SDP | CHIP_SECTOR_WRITE | CHIP_ERASE },
+	{ "SST39SF010A",	0xBF, 0xB5, 17, 12,  1,  70,  40,    20,  25,   100, CHIP_ID | CHIP_NOR },
+	{ "AM29F010",	0x01, 0x20, 17, 14,  1, 150, 100,   500, 15000, 60000, CHIP_ID | CHIP_NOR },
+	{ "27C256",	0x00, 0x00, 15, 0,   0, 250,   0,     0,   0,     0, 0 },
+	{ "27C512",	0x00, 0x00, 16, 0,   0, 250,   0,     0,   0,     0, 0 },
+	{ "27C010",	0x00, 0x00, 17, 0,   0, 250,   0,     0,   0,     0, 0 },
+};
+
+#define CHIP_PROFILES (sizeof(chip_profiles) / sizeof(*chip_profiles))
+
+uint8_t chip_count(void) {
+	return CHIP_PROFILES;
+}
+
+void chip_get(uint8_t i, chip_profile* p) {
+	memcpy_P(p, &chip_profiles[i], sizeof(*p));
+}
+
+// Profile of a part that answered the software ID, CHIP_NONE if unknown
+uint8_t chip_find(uint8_t mfr, uint8_t dev) {
+	for (uint8_t i = 0; i < CHIP_PROFILES; i++) {
+		if (!(pgm_read_byte(&chip_profiles[i].flags) & CHIP_ID))
+			continue;
+		if (pgm_read_byte(&chip_profiles[i].mfr) == mfr &&
+		    pgm_read_byte(&chip_profiles[i].dev) == dev)
+			return i;
+	}
+	return CHIP_NONE;
+}
+
+static void chip_send16(uint16_t v) {
+	SEND(v);
+	SEND(v >> 8);
+}
+
+// Answer to S_CMD_Q_CHIP: the profile field by field, 16-bit values LE
+void chip_send(uint8_t i) {
+	chip_profile p;
+
+	chip_get(i, &p);
+	for (uint8_t n = 0; n < CHIP_NAME_LEN; n++)
+		SEND(p.name[n]);
+	SEND(p.mfr);
+	SEND(p.dev);
+	SEND(p.size_shift);
+	SEND(p.sector_shift);
+	chip_send16(p.page);
+	chip_send16(p.tacc_ns);
+	chip_send16(p.twp_ns);
+	chip_send16(p.twc_us);
+	chip_send16(p.tse_ms);
+	chip_send16(p.tce_ms);
+	SEND(p.flags);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* CHIP PROFILES HEADER */
+/* Parts the programmer knows, with datasheet timings of their slowest speed
+ * grade. The table lives in program memory. */
+#define CHIP_NAME_LEN 12
+#define CHIP_NONE 0xFF		// No profile: worst case timings
+
+#define CHIP_ID		_BV(0)	// Answers the software ID sequence
+#define CHIP_SDP	_BV(1)	// Software data protection
+#define CHIP_SECTOR_WRITE	_BV(2)	// A write cycle rewrites the whole page
+#define CHIP_NOR	_BV(3)	// Commands to program a byte, to erase
+#define CHIP_ERASE	_BV(4)	// EEPROM with the software chip erase sequence
+
+typedef struct {
+	char name[CHIP_NAME_LEN];	// Zero padded
+	uint8_t mfr, dev;	// Software ID, with CHIP_ID
+	uint8_t size_shift;	// Size is 1 << size_shift bytes
+	uint8_t sector_shift;	// Erase sector, 0 when erased by writing
+	uint16_t page;		// Bytes per write cycle, 0 when not writable
+	uint16_t tacc_ns;	// Address to data out
+	uint16_t twp_ns;	// ~WE pulse width
+	uint16_t twc_us;	// Write cycle or byte program, max
+	uint16_t tse_ms;	// Sector erase, max
+	uint16_t tce_ms;	// Chip erase, max (NOR or CHIP_ERASE)
+	uint8_t flags;
+} chip_profile;
+
+uint8_t chip_count(void);
+void chip_get(uint8_t i, chip_profile* p);
+uint8_t chip_find(uint8_t mfr, uint8_t dev);
+void chip_send(uint8_t i);
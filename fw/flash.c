@@ -21,8 +21,47 @@
 #include "main.h"
 #include "flash.h"
 #include "uart.h"
+#include "rle.h"
+#include "chips.h"
 
 static uint32_t errors_cnt = 0;
+// Write-N page size, always a power of two. 1 means byte mode.
+static uint16_t page_size = 1;
+// Address on the pins, valid only after a full latch: power-up and
+// flash_set_safe() leave the shift registers unknown
+static uint32_t latched_addr;
+static uint8_t latch_valid;
+
+// Performance counters, sent by flash_perf_send(). Times are in Timer1
+// ticks of 8 clocks (0.5us).
+static struct {
+	uint32_t poll_total;	// data_polling() iterations
+	uint32_t poll_max;	// Longest data_polling(), in iterations
+	uint32_t bytes_read;
+	uint32_t bytes_written;
+	uint32_t read_ticks;	// Read cycles, waiting for the link excluded
+	uint32_t write_ticks;	// Page loads and data polling
+} perf;
+
+// Timer1 ticks (0.5us). 28Cxxx datasheets give tWC up to 10ms.
+#define TWC_TIMEOUT 40000	// 20ms, before anything is learned
+#define TWC_TIMEOUT_MIN 2000	// 1ms
+// Page loads end tBLC (150us max) after the last byte: the chip may not be
+// busy yet
+#define TWC_START 300
+
+// Write completion, see data_polling(). Learned again for every chip.
+static uint16_t twc_ticks;	// Typical write cycle, 0 until one completed
+static uint8_t dq6_toggles;	// Chip toggles DQ6 while busy
+
+// Timings of the chip profile in use, see flash_set_chip(). Until one is
+// chosen they suit any chip.
+static uint8_t fast_access;	// tACC is over before the bus is sampled
+static uint8_t fast_we;		// tWP is met by a two cycle ~WE pulse
+static uint16_t twc_timeout = TWC_TIMEOUT;	// Give up on a write cycle
+static uint8_t nor;		// Flash: program and erase with commands
+static uint8_t eeprom_erase;	// EEPROM with the software chip erase
+static uint16_t tse_ms, tce_ms;	// Sector and chip erase, max
 
 static uint8_t flash_databus_read(void) {
 	uint8_t rv;
@@ -72,7 +111,17 @@ void flash_init(void) {
 	// a16 is out of shift registers
 	PORTB &= ~_BV(5);
 	DDRB |= _BV(5);
+	latch_valid = 0;
 	// ADDR unit init done
+
+	twc_ticks = 0;
+	dq6_toggles = 0;
+	// Until told which chip this is
+	flash_set_chip(CHIP_NONE);
+
+	// Timer1 free running at F_CPU/8, for the performance counters
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11);
 	
 	// Powercontrol
 	PORTB |= _BV(4);
@@ -113,62 +162,66 @@ static void flash_output_disable(void) {
 	PORTD |= _BV(4);
 }
 
+// Clock one address bit into the 74HC595 chain: data with the clock low,
+// then the clock rising, two single cycle stores of the whole port. That is
+// more than the 595 setup time and clock pulse width. lo is PORTD with
+// data and clock low: no interrupt handler touches PORTD.
+#define SHIFT_BIT(v, b) do { \
+	const uint8_t d = ((v) & _BV(b)) ? lo | _BV(7) : lo; \
+	PORTD = d; \
+	PORTD = d | _BV(5); \
+} while (0)
+
+#define SHIFT_BYTE(v) do { \
+	SHIFT_BIT(v, 7); SHIFT_BIT(v, 6); SHIFT_BIT(v, 5); SHIFT_BIT(v, 4); \
+	SHIFT_BIT(v, 3); SHIFT_BIT(v, 2); SHIFT_BIT(v, 1); SHIFT_BIT(v, 0); \
+} while (0)
+
 static void flash_setaddr(uint32_t addr) {
-	uint8_t a16 = (addr >> 16) & 1;
-	
-	uint8_t part = addr >> 8;
-	for (uint8_t i = 8; i > 0; i--) {
-		uint8_t bit = part & 0x80;
-		if (bit)
-			PORTD |= _BV(7);
+	uint32_t changed = addr ^ latched_addr;
+
+	if (!latch_valid)
+		changed = 0x1FFFF;
+	else if (!changed)
+		return;
+
+	// a16 is out of shift registers, no need to touch the chain for it
+	if (changed & 0x10000) {
+		if (addr & 0x10000)
+			PORTB |= _BV(5);
 		else
-			PORTD &= ~_BV(7);
-		
-		// Shift pulse
-		// _delay_us(1);
-		asm("nop\n\rnop");
-		PORTD |= _BV(5);
-		asm("nop\n\rnop");
-		// _delay_us(1);
-		PORTD &= ~_BV(5);
-		
-		part <<= 1;
+			PORTB &= ~_BV(5);
 	}
-	
-	part = addr;
-	for (int i = 8; i > 0; i--) {
-		uint8_t bit = part & 0x80;
-		if (bit)
-			PORTD |= _BV(7);
-		else
-			PORTD &= ~_BV(7);
-		
-		// Shift pulse
-		// _delay_us(1);
-		asm("nop\n\rnop");
-		PORTD |= _BV(5);
-		asm("nop\n\rnop");
-		// _delay_us(1);
-		PORTD &= ~_BV(5);
-		
-		part <<= 1;
+
+	// The low byte lives in the 595 next to the MCU: a daisy chain cannot
+	// update it alone, so any change in A0-A15 shifts all 16 bits.
+	if ((uint16_t)changed) {
+		const uint8_t lo = PORTD & ~(_BV(5) | _BV(6) | _BV(7));
+		uint8_t part = addr >> 8;
+		SHIFT_BYTE(part);
+		part = addr;
+		SHIFT_BYTE(part);
+
+		// Pulse latch
+		PORTD = lo | _BV(6);
+		PORTD = lo;
 	}
-	
-	if (a16)
-		PORTB |= _BV(5);
-	else
-		PORTB &= ~_BV(5);
-	
-	// Pulse latch
-	// _delay_us(1);
-	asm("nop\n\rnop");
-	PORTD |= _BV(6);
-	asm("nop\n\rnop");
-	// _delay_us(1);
-	PORTD &= ~_BV(6);
+
+	latched_addr = addr;
+	latch_valid = 1;
+}
+
+// sbi/cbi: ~WE is low for two cycles (125ns)
+static void flash_pulse_we_short(void) {
+  PORTD &= ~(_BV(2));
+  PORTD |= _BV(2);
 }
 
 static void flash_pulse_we(void) {
+	if (fast_we) {
+		flash_pulse_we_short();
+		return;
+	}
 	_delay_us(1);
 	PORTD &= ~(_BV(2));
 	_delay_us(1);
@@ -180,12 +233,26 @@ static void flash_read_init(void) {
 	flash_output_enable();
 }
 
-// assume chip enabled & output enabled & databus tristate
-static uint8_t flash_readcycle(uint32_t addr) {
-	_delay_us(1);
+// Address to data out (tACC), with margin for old NMOS EPROMs
+#define TACC_US 0.5
+
+// Reads run one address ahead, from addr on. Call flash_read_init() first.
+static void flash_read_start(uint32_t addr) {
 	flash_setaddr(addr);
-	_delay_us(1);
-	return flash_databus_read();
+	if (!fast_access)
+		_delay_us(TACC_US);
+}
+
+// Sample the byte, then latch the next address right away: it settles while
+// the byte is handed over and the caller loops, which takes longer than tACC
+static uint8_t flash_read_next(void) {
+	const uint16_t start = TCNT1;
+	const uint8_t data = flash_databus_read();
+
+	flash_setaddr(latched_addr + 1);
+
+	perf.read_ticks += (uint16_t)(TCNT1 - start);
+	return data;
 }
 
 // assume only CE, and perform single cycle
@@ -195,7 +262,7 @@ uint8_t flash_read(uint32_t addr) {
 
 	uint8_t data;
 	flash_read_init();
-	flash_setaddr(addr);
+	flash_read_start(addr);
 	data = flash_databus_read();
 	flash_output_disable();
 
@@ -205,31 +272,129 @@ uint8_t flash_read(uint32_t addr) {
 	return data;
 }
 
+// Read what the chip shows while it is busy
+static uint8_t flash_status(void) {
+	uint8_t v;
+
+	flash_output_enable();
+	_delay_us(0.25);	// tOE
+	v = flash_databus_read();
+	flash_output_disable();
+	return v;
+}
+
+// Wait for the write cycle started by the last ~WE to complete, val being
+// the last byte written. Returns 1 on failure.
+// The chip is left alone for most of the typical tWC, then polled: DQ7 is
+// inverted until the data is there. Chips that toggle DQ6 while busy also
+// tell when they stopped without taking the data, so they fail right away.
 uint8_t data_polling(const uint8_t val) {
+	const uint16_t start = TCNT1;
+	uint16_t timeout = twc_timeout;
+	uint16_t elapsed;
+	uint16_t i = 0;
+	uint16_t busy = 0, toggled = 0;
 	uint8_t ret = 1;
-	_delay_us(1);
+	uint8_t prev, cur;
+
+	if (twc_ticks) {
+		const uint16_t idle = twc_ticks - twc_ticks / 4;
+
+		if (twc_ticks < timeout / 4)
+			timeout = twc_ticks * 4;
+		if (timeout < TWC_TIMEOUT_MIN)
+			timeout = TWC_TIMEOUT_MIN;
+		while ((uint16_t)(TCNT1 - start) < idle);
+	}
+
 	flash_databus_tristate();
-	for (uint16_t i = 0; i < 0xFFFF && ret != 0; i++) {
-		flash_output_enable();
-		_delay_us(1);
-		if (val == flash_databus_read())
+	prev = flash_status();
+
+	do {
+		i++;
+		cur = flash_status();
+		elapsed = TCNT1 - start;
+
+		if (cur == val && prev == val) {
 			ret = 0;
-		flash_output_disable();
-		_delay_us(1);
+			break;
+		}
+		if (cur != val && prev != val) {
+			busy++;
+			if ((cur ^ prev) & _BV(6))
+				toggled++;
+			else if (dq6_toggles && cur == prev && elapsed > TWC_START)
+				break;	// Idle, with the wrong data
+		}
+		prev = cur;
+	} while (elapsed < timeout);
+
+	perf.poll_total += i;
+	if (i > perf.poll_max)
+		perf.poll_max = i;
+
+	// Learn from good cycles only, averaging over the last few. DQ6 counts
+	// when it toggled on every busy read: floating bits may change too.
+	if (!ret) {
+		twc_ticks = twc_ticks ? twc_ticks - twc_ticks / 8 + elapsed / 8 : elapsed;
+		if (busy >= 2 && toggled == busy)
+			dq6_toggles = 1;
 	}
+
 	return ret;
 }
 
+static void flash_write_sync(const uint16_t addr, const uint8_t data) {
+  flash_databus_output(data);
+  flash_setaddr(addr);
+  flash_pulse_we();
+}
+
+// Unlock cycles, then the command, as JEDEC flash parts take them
+static void flash_command(uint8_t cmd) {
+	flash_output_disable();
+	flash_write_sync(0x5555, 0xAA);
+	flash_write_sync(0x2AAA, 0x55);
+	flash_write_sync(0x5555, cmd);
+}
+
+// NOR flash takes one byte per program command, and can only clear bits:
+// 0xFF is what an erased byte holds already, so it is skipped
+static void flash_program(uint32_t addr, const uint8_t* data, uint32_t len) {
+	do {
+		const uint16_t start = TCNT1;
+
+		if (*data != 0xFF) {
+			flash_command(0xA0);
+			flash_databus_output(*data);
+			flash_setaddr(addr);
+			flash_pulse_we();
+			errors_cnt += data_polling(*data);
+		}
+		perf.write_ticks += (uint16_t)(TCNT1 - start);
+		addr++;
+		data++;
+	} while (--len);
+}
+
 // assume only CE, perform single cycle
 void flash_write(uint32_t addr, uint8_t data) {
+	const uint16_t start = TCNT1;
+
 	// turn on write led
 	PORTC |= _BV(5);
 
-	flash_output_disable();
-	flash_databus_output(data);
-	flash_setaddr(addr);
-	flash_pulse_we();
-	errors_cnt += data_polling(data);
+	if (nor) {
+		flash_program(addr, &data, 1);
+	} else {
+		flash_output_disable();
+		flash_databus_output(data);
+		flash_setaddr(addr);
+		flash_pulse_we();
+		errors_cnt += data_polling(data);
+		perf.write_ticks += (uint16_t)(TCNT1 - start);
+	}
+	perf.bytes_written++;
 
 	// turn off write led
 	PORTC &= ~_BV(5);
@@ -249,20 +414,48 @@ void flash_write_fast(uint32_t addr, uint8_t data) {
 	PORTC &= ~_BV(5);
 }
 
+uint8_t flash_set_page_size(uint16_t size) {
+	// Page must be a power of two, 28Cxxx pages are 64 to 256 bytes
+	if (size == 0 || size > 512 || (size & (size - 1)))
+		return 0;
+	page_size = size;
+	return 1;
+}
+
 // assume only CE, perform whole cycle
+// Bytes of the same page are loaded back-to-back, well within tBLC, then the
+// last one is polled: the chip programs the whole page in a single tWC.
 void flash_writen(uint32_t addr, uint8_t* data, uint32_t len) {
 	// turn on write led
 	PORTC |= _BV(5);
 
 	flash_output_disable();
+	perf.bytes_written += len;
+
+	if (nor) {
+		flash_program(addr, data, len);
+		PORTC &= ~_BV(5);
+		return;
+	}
 
 	do {
-		flash_setaddr(addr++);
-		flash_databus_output(*(data));
-		flash_pulse_we();
-		errors_cnt += data_polling(*data);
-		data++;
-	} while(--len);
+		// One page at a time: Timer1 wraps after 32ms
+		const uint16_t start = TCNT1;
+		uint16_t left = page_size - (addr & (page_size - 1));
+		if (left > len)
+			left = len;
+		len -= left;
+
+		do {
+			flash_setaddr(addr++);
+			flash_databus_output(*(data));
+			flash_pulse_we();
+			data++;
+		} while(--left);
+
+		errors_cnt += data_polling(*(data - 1));
+		perf.write_ticks += (uint16_t)(TCNT1 - start);
+	} while(len);
 
 	// turn off write led
 	PORTC &= ~_BV(5);
@@ -273,38 +466,389 @@ void flash_readn(uint32_t addr, uint32_t len) {
 	PORTC |= _BV(4);
 
 	flash_read_init();
+	flash_read_start(addr);
+	perf.bytes_read += len;
+	do {
+		SEND(flash_read_next());
+	} while(--len);
+	// safety features
+	flash_output_disable();
+
+	// turn off read led
+	PORTC &= ~_BV(4);
+}
+
+// Same as flash_readn, but the stream is RLE encoded
+void flash_readn_rle(uint32_t addr, uint32_t len) {
+	// turn on read led
+	PORTC |= _BV(4);
+
+	flash_read_init();
+	flash_read_start(addr);
+	perf.bytes_read += len;
+	rle_send_init();
+	do {
+		rle_send(flash_read_next());
+	} while(--len);
+	rle_send_flush();
+	// safety features
+	flash_output_disable();
+
+	// turn off read led
+	PORTC &= ~_BV(4);
+}
+
+// A majority needs an odd number of samples, and the unstable offsets are
+// 16-bit
+uint8_t flash_vote_valid(uint32_t len, uint8_t mode) {
+	const uint8_t passes = mode & VOTE_PASSES;
+
+	if (mode & ~(VOTE_PASSES | VOTE_VARY_TACC))
+		return 0;
+	return passes % 2 && len && len <= 0x10000;
+}
+
+// Majority of a few samples of each byte, for EPROMs with weak bits that
+// read one way or the other from one access to the next. Every sample is a
+// new output access. With VOTE_VARY_TACC the address is presented again for
+// each sample (A0 flipped, then back) and sample n is taken n * 0.5us after
+// it changed: the first ones come before tACC, and bits that are slow to
+// settle show up as unstable.
+// Streams the voted bytes, then how many of them had samples that disagreed
+// (16-bit LE, saturated) and the offsets of the first VOTE_LIST of them.
+// Offsets are 16-bit: len is 64 KiB at most.
+void flash_readn_vote(uint32_t addr, uint32_t len, uint8_t mode) {
+	const uint8_t passes = mode & VOTE_PASSES;
+	uint8_t sample[VOTE_PASSES];
+	uint16_t list[VOTE_LIST];
+	uint16_t unstable = 0;
+	uint16_t off = 0;
+
+	// turn on read led
+	PORTC |= _BV(4);
+
+	flash_output_disable();
+	flash_databus_tristate();
+	perf.bytes_read += len;
+	do {
+		const uint16_t start = TCNT1;
+		uint8_t diff = 0, voted;
+
+		if (!(mode & VOTE_VARY_TACC)) {
+			flash_setaddr(addr);
+			_delay_us(TACC_US);
+		}
+		for (uint8_t n = 0; n < passes; n++) {
+			if (mode & VOTE_VARY_TACC) {
+				flash_setaddr(addr ^ 1);
+				flash_setaddr(addr);
+				for (uint8_t d = 0; d < n; d++)
+					_delay_us(0.5);
+			}
+			sample[n] = flash_status();
+			diff |= sample[n] ^ sample[0];
+		}
+
+		// Bit by bit, only for the bits that changed
+		voted = sample[0] & ~diff;
+		for (uint8_t b = 0; diff >> b; b++) {
+			uint8_t ones = 0;
+
+			if (!(diff & _BV(b)))
+				continue;
+			for (uint8_t n = 0; n < passes; n++)
+				ones += (sample[n] >> b) & 1;
+			if (ones * 2 > passes)
+				voted |= _BV(b);
+		}
+		if (diff) {
+			if (unstable < VOTE_LIST)
+				list[unstable] = off;
+			if (unstable != 0xFFFF)
+				unstable++;
+		}
+		perf.read_ticks += (uint16_t)(TCNT1 - start);
+
+		SEND(voted);
+		addr++;
+		off++;
+	} while (--len);
+
+	SEND(unstable);
+	SEND(unstable >> 8);
+	for (uint8_t i = 0; i < unstable && i < VOTE_LIST; i++) {
+		SEND(list[i]);
+		SEND(list[i] >> 8);
+	}
+
+	// turn off read led
+	PORTC &= ~_BV(4);
+}
+
+// CRC-32 (IEEE 802.3, reflected) nibble table: 64 bytes of flash instead
+// of the 1 KiB byte-wide table
+static const uint32_t crc32_nibble[16] PROGMEM = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t flash_crc32(uint32_t addr, uint32_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+
+	// turn on read led
+	PORTC |= _BV(4);
+
+	flash_read_init();
+	flash_read_start(addr);
+	perf.bytes_read += len;
 	do {
-		SEND(flash_readcycle(addr++));
+		crc ^= flash_read_next();
+		crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibble[crc & 0x0F]);
+		crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibble[crc & 0x0F]);
 	} while(--len);
 	// safety features
 	flash_output_disable();
 
 	// turn off read led
 	PORTC &= ~_BV(4);
+
+	return ~crc;
+}
+
+// Count the bytes that are not in the erased state (0xFF)
+uint32_t flash_blank_check(uint32_t addr, uint32_t len) {
+	uint32_t dirty = 0;
+
+	// turn on read led
+	PORTC |= _BV(4);
+
+	flash_read_init();
+	flash_read_start(addr);
+	perf.bytes_read += len;
+	do {
+		if (flash_read_next() != 0xFF)
+			dirty++;
+	} while(--len);
+	// safety features
+	flash_output_disable();
+
+	// turn off read led
+	PORTC &= ~_BV(4);
+
+	return dirty;
+}
+
+static void flash_send32(uint32_t v) {
+	SEND(v);
+	SEND(v >> 8);
+	SEND(v >> 16);
+	SEND(v >> 24);
+}
+
+// Answer to S_CMD_Q_PERF, flash part: six 32-bit LE counters, after the
+// UART part
+void flash_perf_send(uint8_t clear) {
+	flash_send32(perf.poll_total);
+	flash_send32(perf.poll_max);
+	flash_send32(perf.bytes_read);
+	flash_send32(perf.bytes_written);
+	flash_send32(perf.read_ticks);
+	flash_send32(perf.write_ticks);
+
+	if (clear)
+		memset(&perf, 0, sizeof(perf));
+}
+
+// Use the timings of profile i, CHIP_NONE for the worst case. Returns 0 if
+// there is no such profile.
+uint8_t flash_set_chip(uint8_t i) {
+	chip_profile p;
+	uint32_t timeout;
+
+	if (i == CHIP_NONE) {
+		fast_access = 0;
+		fast_we = 0;
+		twc_timeout = TWC_TIMEOUT;
+		nor = 0;
+		eeprom_erase = 0;
+		return 1;
+	}
+	if (i >= chip_count())
+		return 0;
+
+	chip_get(i, &p);
+	// Sampling comes at least 16 cycles after the address is latched
+	fast_access = p.tacc_ns <= 1000;
+	fast_we = p.twp_ns <= 100;
+	// Twice the datasheet maximum
+	timeout = (uint32_t)p.twc_us * 4;
+	if (timeout < TWC_TIMEOUT_MIN)
+		timeout = TWC_TIMEOUT_MIN;
+	if (timeout > TWC_TIMEOUT)
+		timeout = TWC_TIMEOUT;
+	twc_timeout = timeout;
+	nor = p.flags & CHIP_NOR;
+	eeprom_erase = p.flags & CHIP_ERASE;
+	tse_ms = p.tse_ms;
+	tce_ms = p.tce_ms;
+	return 1;
+}
+
+// Erase in progress: DQ7 reads 0 until it is over, then the chip reads
+// 0xFF. Returns 1 if it takes longer than timeout_ms.
+static uint8_t erase_polling(uint16_t timeout_ms) {
+	uint16_t start = TCNT1;
+	uint16_t ms = 0;
+	uint8_t ret = 1;
+
+	flash_databus_tristate();
+	while (ms < timeout_ms) {
+		if (flash_status() == 0xFF && flash_status() == 0xFF) {
+			ret = 0;
+			break;
+		}
+		// Timer1 wraps after 32ms
+		if ((uint16_t)(TCNT1 - start) >= 2000) {
+			start += 2000;
+			ms++;
+		}
+	}
+
+	perf.write_ticks += (uint32_t)ms * 2000 + (uint16_t)(TCNT1 - start);
+	return ret;
+}
+
+// Erase the sector holding addr, or the whole chip, on NOR flash; the whole
+// chip on EEPROMs with the chip erase. Returns 0 when done, 1 on timeout,
+// FLASH_ERASE_NONE if the chip in use can't.
+uint8_t flash_erase(uint32_t addr, uint8_t what) {
+	uint16_t timeout;
+	uint8_t ret;
+
+	if (!nor) {
+		if (!eeprom_erase || what != FLASH_ERASE_CHIP)
+			return FLASH_ERASE_NONE;
+		flash_chip_clear();
+		return 0;
+	}
+
+	// turn on write led
+	PORTC |= _BV(5);
+
+	flash_command(0x80);
+	if (what == FLASH_ERASE_CHIP) {
+		flash_command(0x10);
+		timeout = tce_ms;
+	} else {
+		flash_write_sync(0x5555, 0xAA);
+		flash_write_sync(0x2AAA, 0x55);
+		flash_databus_output(0x30);
+		flash_setaddr(addr);
+		flash_pulse_we();
+		timeout = tse_ms;
+	}
+	// Twice the datasheet maximum
+	ret = erase_polling(timeout > 0x7FFF ? 0xFFFF : timeout * 2);
+
+	// turn off write led
+	PORTC &= ~_BV(5);
+	return ret;
+}
+
+// Where the ID sequences land on an EEPROM without software ID: the command
+// addresses, and 0x2AAA folded into the page of 0x5555 for 32, 64 and 128
+// byte pages
+static const uint16_t id_spill[] PROGMEM = {
+	0x5555, 0x2AAA, 0x554A, 0x556A, 0x552A
+};
+#define ID_SPILL (sizeof(id_spill) / sizeof(*id_spill))
+
+static void flash_id_command(uint8_t cmd) {
+	flash_command(cmd);
+	// tIDA of 29C parts, or the write cycle of an EEPROM that took it as data:
+	// it starts when the page load window closes, 10ms is its maximum
+	_delay_ms(11);
+}
+
+// Software ID: in ID mode the chip answers with its JEDEC manufacturer and
+// device code at 0 and 1. Chips without it go on showing their content, and
+// the bytes the sequences may have written are put back. The profile found
+// is put to use. Returns its index, CHIP_NONE if unknown; mfr and dev are
+// 0 if the chip did not answer.
+uint8_t flash_detect(uint8_t* mfr, uint8_t* dev) {
+	uint8_t saved[ID_SPILL];
+	uint8_t data0, data1, i;
+
+	for (i = 0; i < ID_SPILL; i++)
+		saved[i] = flash_read(pgm_read_word(&id_spill[i]));
+	data0 = flash_read(0);
+	data1 = flash_read(1);
+
+	flash_id_command(0x90);
+	*mfr = flash_read(0);
+	*dev = flash_read(1);
+	flash_id_command(0xF0);
+
+	for (i = 0; i < ID_SPILL; i++) {
+		const uint16_t addr = pgm_read_word(&id_spill[i]);
+
+		if (flash_read(addr) != saved[i])
+			flash_write(addr, saved[i]);
+	}
+
+	if (*mfr == data0 && *dev == data1) {
+		*mfr = 0;
+		*dev = 0;
+		return CHIP_NONE;
+	}
+
+	i = chip_find(*mfr, *dev);
+	if (i != CHIP_NONE)
+		flash_set_chip(i);
+	return i;
 }
 
 void flash_select_protocol(uint8_t allowed_protocols) {
 	(void)allowed_protocols;
+
+	// Byte mode unless the host asks for pages again: a page size left by
+	// an earlier session would fold its writes into the wrong pages
+	page_size = 1;
+
+	// Already powered, don't glitch the supply
+	if ((DDRB & _BV(4)) && !(PORTB & _BV(4)))
+		return;
+
 	flash_init();
 
 	// Turn on power supply
 	PORTB &= ~_BV(4);
+	// Writes are inhibited for a few ms after power up (tPUW)
+	_delay_ms(10);
 }
 
+// Socket can be powered down and the chip swapped. libfrser calls this on
+// S_CMD_S_PIN_STATE off only, which comes between commands: an opbuf has
+// been executed up to the end of data polling by then, and erases wait for
+// the chip too, so no write cycle is cut short unless it already timed out.
 void flash_set_safe(void) {
+	flash_output_disable();
+	// Deselected while the supply falls
+	flash_chip_disable();
+	flash_databus_tristate();
+
 	// Turn off power supply
-	// PORTB |= _BV(4);
-}
+	PORTB |= _BV(4);
 
-static void flash_pulse_we_short(void) {
-  PORTD &= ~(_BV(2));
-  PORTD |= _BV(2);
-}
+	// Lines left high would feed the chip through its protection diodes
+	flash_setaddr(0);
+	PORTD &= ~(_BV(2) | _BV(3) | _BV(4));
+	PORTC &= ~(_BV(4) | _BV(5));
 
-static void flash_write_sync(const uint16_t addr, const uint8_t data) {
-  flash_databus_output(data);
-  flash_setaddr(addr);
-  flash_pulse_we();
+	// Next chip starts from scratch
+	latch_valid = 0;
 }
 
 void flash_reset_sdp(void) {
@@ -325,6 +869,27 @@ void flash_reset_sdp(void) {
 	PORTC &= ~_BV(5);
 }
 
+// Software chip erase of 28C EEPROMs: every byte reads 0xFF after tCE. The
+// chip can't be polled meanwhile, the whole time is waited.
+void flash_chip_clear(void) {
+	flash_output_disable();
+
+	flash_write_fast(0x5555, 0xaa);
+	flash_write_fast(0x2aaa, 0x55);
+	flash_write_fast(0x5555, 0x80);
+	flash_write_fast(0x5555, 0xaa);
+	flash_write_fast(0x2aaa, 0x55);
+	flash_write_fast(0x5555, 0x10);
+
+	// turn on write led
+	PORTC |= _BV(5);
+	for (uint16_t ms = 0; ms < tce_ms; ms++)
+		_delay_ms(1);
+	perf.write_ticks += (uint32_t)tce_ms * 2000;
+	// turn off write led
+	PORTC &= ~_BV(5);
+}
+
 void flash_set_sdp(void) {
   flash_output_disable();
 	
@@ -19,4 +19,21 @@
  */
 
 void flash_init(void);
+uint8_t flash_set_page_size(uint16_t size);
+uint32_t flash_blank_check(uint32_t addr, uint32_t len);
+uint32_t flash_crc32(uint32_t addr, uint32_t len);
+void flash_readn_rle(uint32_t addr, uint32_t len);
+#define VOTE_PASSES 0x0F	// Mode: samples per byte, at most 15
+#define VOTE_VARY_TACC 0x80	// Mode: sample n comes n * 0.5us later
+#define VOTE_LIST 16		// Unstable offsets listed per read
+uint8_t flash_vote_valid(uint32_t len, uint8_t mode);
+void flash_readn_vote(uint32_t addr, uint32_t len, uint8_t mode);
+void flash_perf_send(uint8_t clear);
+uint8_t flash_set_chip(uint8_t i);
+uint8_t flash_detect(uint8_t* mfr, uint8_t* dev);
+#define FLASH_ERASE_SECTOR 0
+#define FLASH_ERASE_CHIP 1
+#define FLASH_ERASE_NONE 2	// The chip in use has no such erase
+uint8_t flash_erase(uint32_t addr, uint8_t what);
+void flash_chip_clear(void);
 #include "frser-flashapi.h"
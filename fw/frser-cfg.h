@@ -29,6 +29,12 @@
 
 /* Optionally, if you want to make the auto-OPBUF-sizing code leave more/less RAM space for
  * rest of the system, define this. Default is below. Not needed for SPI-only flashers. */
-#define FRSER_SYS_BYTES 64
+/* Statics outside the opbuf and the UART rings: 64 bytes (flash.c 44, uart.c 12,
+ * rle.c 2, frser.c 2, counted from the symbol table). Stack, worst case: the
+ * frser_main frame (~22) and flash_readn_vote with its samples and list (~67),
+ * then uart_send and the RX ISR on top (~26), 115 bytes; the flash_detect and
+ * opbuf exec chains stay under it. 128 are left for it. These are estimates:
+ * --stats reports how close the stack came to the buffers on the target. */
+#define FRSER_SYS_BYTES (64 + 128)
 
 #endif
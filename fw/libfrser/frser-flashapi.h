@@ -0,0 +1,29 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* WHAT THE FLASHER PROVIDES TO LIBFRSER */
+void flash_select_protocol(uint8_t allowed_protocols);
+uint8_t flash_read(uint32_t addr);
+void flash_readn(uint32_t addr, uint32_t len);
+void flash_write(uint32_t addr, uint8_t data);
+void flash_writen(uint32_t addr, uint8_t* data, uint32_t len);
+void flash_set_safe(void);
+void flash_reset_sdp(void);
+void flash_set_sdp(void);
+void flash_error_cnt_reset(void);
+uint32_t flash_error_cnt(void);
@@ -0,0 +1,421 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "main.h"
+#include "uart.h"
+#include "rle.h"
+#include "flash.h"
+#include "chips.h"
+#include "frser.h"
+#include "frser-cfg.h"
+#include "serprog.h"
+
+// RAM left to the rest of the system: its variables and the stack
+#ifndef FRSER_SYS_BYTES
+#define FRSER_SYS_BYTES 320
+#endif
+
+// The operation buffer gets whatever RAM the UART buffers and the rest of
+// the system leave
+#define S_OPBUF_LEN (RAMEND + 1 - RAMSTART - UART_BUFLEN - UARTTX_BUFLEN - FRSER_SYS_BYTES)
+// Write-N record in the opbuf: opcode, 24-bit length, 24-bit address, data
+#define S_WRITEN_HDR 7
+
+static uint8_t opbuf[S_OPBUF_LEN];
+static uint16_t opbuf_bytes;
+
+static const char frser_name[16] PROGMEM = FRSER_NAME;
+
+// Commands answered by frser_main(), for S_CMD_Q_CMDMAP
+static const uint8_t frser_cmds[] PROGMEM = {
+	S_CMD_NOP, S_CMD_Q_IFACE, S_CMD_Q_CMDMAP, S_CMD_Q_PGMNAME,
+	S_CMD_Q_SERBUF, S_CMD_Q_BUSTYPE, S_CMD_Q_CHIPSIZE, S_CMD_Q_OPBUF,
+	S_CMD_Q_WRNMAXLEN, S_CMD_R_BYTE, S_CMD_R_NBYTES, S_CMD_O_INIT,
+	S_CMD_O_WRITEB, S_CMD_O_WRITEN, S_CMD_O_DELAY, S_CMD_O_EXEC,
+	S_CMD_SYNCNOP, S_CMD_Q_RDNMAXLEN, S_CMD_S_BUSTYPE,
+#ifdef FRSER_FEAT_PIN_STATE
+	S_CMD_S_PIN_STATE,
+#endif
+	S_CMD_O_RESET_SDP, S_CMD_O_SET_SDP, S_CMD_S_ERRORCNT_RESET,
+	S_CMD_Q_ERRORCNT, S_CMD_S_PAGESIZE, S_CMD_S_BAUD, S_CMD_Q_BLANK,
+	S_CMD_Q_CRC32, S_CMD_R_NBYTES_RLE, S_CMD_O_WRITEN_RLE, S_CMD_Q_PERF,
+	S_CMD_Q_CHIPID, S_CMD_Q_CHIP, S_CMD_S_CHIP, S_CMD_S_ERASE,
+	S_CMD_R_NBYTES_VOTE,
+};
+
+static uint32_t frser_recv24(void) {
+	uint32_t v;
+
+	v = RECEIVE();
+	v |= (uint32_t)RECEIVE() << 8;
+	v |= (uint32_t)RECEIVE() << 16;
+	return v;
+}
+
+static void frser_send16(uint16_t v) {
+	SEND(v);
+	SEND(v >> 8);
+}
+
+static void frser_send24(uint32_t v) {
+	frser_send16(v);
+	SEND(v >> 16);
+}
+
+static void frser_send32(uint32_t v) {
+	frser_send16(v);
+	frser_send16(v >> 16);
+}
+
+static uint32_t frser_get24(const uint8_t* p) {
+	return p[0] | ((uint16_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+// Arguments of a refused command must not be taken for the next commands
+static void frser_drain(uint32_t len) {
+	while (len--)
+		RECEIVE();
+}
+
+static void frser_send_cmdmap(void) {
+	for (uint8_t i = 0; i < 32; i++) {
+		uint8_t bits = 0;
+
+		for (uint8_t n = 0; n < sizeof(frser_cmds); n++) {
+			const uint8_t op = pgm_read_byte(&frser_cmds[n]);
+
+			if (op / 8 == i)
+				bits |= _BV(op % 8);
+		}
+		SEND(bits);
+	}
+}
+
+static uint8_t frser_opbuf_room(uint32_t len) {
+	return len <= (uint32_t)(S_OPBUF_LEN - opbuf_bytes);
+}
+
+static void frser_udelay(uint32_t us) {
+	while (us--)
+		_delay_us(1);
+}
+
+static void frser_opbuf_exec(void) {
+	uint16_t i = 0;
+
+	while (i < opbuf_bytes) {
+		const uint8_t* r = opbuf + i;
+		uint32_t len;
+
+		switch (r[0]) {
+		case S_CMD_O_WRITEB:
+			flash_write(frser_get24(r + 1), r[4]);
+			i += 5;
+			break;
+		case S_CMD_O_WRITEN:
+			len = frser_get24(r + 1);
+			flash_writen(frser_get24(r + 4), (uint8_t*)r + S_WRITEN_HDR, len);
+			i += S_WRITEN_HDR + len;
+			break;
+		case S_CMD_O_DELAY:
+			frser_udelay(frser_get24(r + 1) | ((uint32_t)r[4] << 24));
+			i += 5;
+			break;
+		case S_CMD_O_RESET_SDP:
+			flash_reset_sdp();
+			i++;
+			break;
+		case S_CMD_O_SET_SDP:
+			flash_set_sdp();
+			i++;
+			break;
+		default:
+			// Can't happen: only the cases above are queued
+			i = opbuf_bytes;
+			break;
+		}
+	}
+	opbuf_bytes = 0;
+}
+
+// Queue an operation with n argument bytes from the link. The arguments are
+// taken in any case.
+static void frser_opbuf_add(uint8_t op, uint8_t n) {
+	if (!frser_opbuf_room(1 + n)) {
+		frser_drain(n);
+		SEND(S_NAK);
+		return;
+	}
+	opbuf[opbuf_bytes++] = op;
+	while (n--)
+		opbuf[opbuf_bytes++] = RECEIVE();
+	SEND(S_ACK);
+}
+
+// Write-N, with the payload as it is or RLE encoded (see rle_recv())
+static void frser_opbuf_writen(uint8_t op) {
+	const uint32_t len = frser_recv24();
+	const uint32_t addr = frser_recv24();
+	uint8_t* r = opbuf + opbuf_bytes;
+	const uint8_t fits = len && frser_opbuf_room(S_WRITEN_HDR + len);
+
+	if (op == S_CMD_O_WRITEN_RLE) {
+		if (!rle_recv(fits ? r + S_WRITEN_HDR : NULL, len) || !fits) {
+			SEND(S_NAK);
+			return;
+		}
+	} else {
+		if (!fits) {
+			frser_drain(len);
+			SEND(S_NAK);
+			return;
+		}
+		for (uint16_t i = 0; i < len; i++)
+			r[S_WRITEN_HDR + i] = RECEIVE();
+	}
+
+	r[0] = S_CMD_O_WRITEN;
+	r[1] = len;
+	r[2] = len >> 8;
+	r[3] = len >> 16;
+	r[4] = addr;
+	r[5] = addr >> 8;
+	r[6] = addr >> 16;
+	opbuf_bytes += S_WRITEN_HDR + len;
+	SEND(S_ACK);
+}
+
+void frser_main(void) {
+	flash_select_protocol(S_BUS_PARALLEL);
+
+	for (;;) {
+		const uint8_t op = RECEIVE();
+		uint32_t addr, len;
+
+		switch (op) {
+		case S_CMD_NOP:
+			SEND(S_ACK);
+			break;
+		case S_CMD_Q_IFACE:
+			SEND(S_ACK);
+			frser_send16(S_IFACE_VERSION);
+			break;
+		case S_CMD_Q_CMDMAP:
+			SEND(S_ACK);
+			frser_send_cmdmap();
+			break;
+		case S_CMD_Q_PGMNAME:
+			SEND(S_ACK);
+			for (uint8_t i = 0; i < sizeof(frser_name); i++)
+				SEND(pgm_read_byte(&frser_name[i]));
+			break;
+		case S_CMD_Q_SERBUF:
+			SEND(S_ACK);
+			frser_send16(UART_BUFLEN);
+			break;
+		case S_CMD_Q_BUSTYPE:
+			SEND(S_ACK);
+			SEND(S_BUS_PARALLEL);
+			break;
+		case S_CMD_Q_CHIPSIZE:
+			SEND(S_ACK);
+			SEND(FRSER_PARALLEL_BITS);
+			break;
+		case S_CMD_Q_OPBUF:
+			SEND(S_ACK);
+			frser_send16(S_OPBUF_LEN);
+			break;
+		case S_CMD_Q_WRNMAXLEN:
+			SEND(S_ACK);
+			frser_send24(S_OPBUF_LEN - S_WRITEN_HDR);
+			break;
+		case S_CMD_R_BYTE:
+			addr = frser_recv24();
+			SEND(S_ACK);
+			SEND(flash_read(addr));
+			break;
+		case S_CMD_R_NBYTES:
+			addr = frser_recv24();
+			len = frser_recv24();
+			if (!len) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			flash_readn(addr, len);
+			break;
+		case S_CMD_R_NBYTES_RLE:
+			addr = frser_recv24();
+			len = frser_recv24();
+			if (!len) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			flash_readn_rle(addr, len);
+			break;
+		case S_CMD_R_NBYTES_VOTE: {
+			uint8_t mode;
+
+			addr = frser_recv24();
+			len = frser_recv24();
+			mode = RECEIVE();
+			if (!flash_vote_valid(len, mode)) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			flash_readn_vote(addr, len, mode);
+			break;
+		}
+		case S_CMD_O_INIT:
+			opbuf_bytes = 0;
+			SEND(S_ACK);
+			break;
+		case S_CMD_O_WRITEB:
+			frser_opbuf_add(op, 4);
+			break;
+		case S_CMD_O_WRITEN:
+		case S_CMD_O_WRITEN_RLE:
+			frser_opbuf_writen(op);
+			break;
+		case S_CMD_O_DELAY:
+			frser_opbuf_add(op, 4);
+			break;
+		case S_CMD_O_EXEC:
+			frser_opbuf_exec();
+			SEND(S_ACK);
+			break;
+		case S_CMD_SYNCNOP:
+			SEND(S_NAK);
+			SEND(S_ACK);
+			break;
+		case S_CMD_Q_RDNMAXLEN:
+			// No limit
+			SEND(S_ACK);
+			frser_send24(0);
+			break;
+		case S_CMD_S_BUSTYPE:
+			SEND(RECEIVE() & S_BUS_PARALLEL ? S_ACK : S_NAK);
+			break;
+#ifdef FRSER_FEAT_PIN_STATE
+		case S_CMD_S_PIN_STATE:
+			// The only place the socket is powered down
+			if (RECEIVE())
+				flash_select_protocol(S_BUS_PARALLEL);
+			else
+				flash_set_safe();
+			SEND(S_ACK);
+			break;
+#endif
+		case S_CMD_O_RESET_SDP:
+		case S_CMD_O_SET_SDP:
+			frser_opbuf_add(op, 0);
+			break;
+		case S_CMD_S_ERRORCNT_RESET:
+			flash_error_cnt_reset();
+			SEND(S_ACK);
+			break;
+		case S_CMD_Q_ERRORCNT:
+			SEND(S_ACK);
+			frser_send32(flash_error_cnt());
+			break;
+		case S_CMD_S_PAGESIZE:
+			len = RECEIVE();
+			len |= (uint16_t)RECEIVE() << 8;
+			SEND(flash_set_page_size(len) ? S_ACK : S_NAK);
+			break;
+		case S_CMD_S_BAUD:
+			len = RECEIVE();
+			if (!uart_baud_supported(len)) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			uart_switch_baud(len);
+			break;
+		case S_CMD_Q_BLANK:
+			addr = frser_recv24();
+			len = frser_recv24();
+			if (!len) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			frser_send32(flash_blank_check(addr, len));
+			break;
+		case S_CMD_Q_CRC32:
+			addr = frser_recv24();
+			len = frser_recv24();
+			if (!len) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			frser_send32(flash_crc32(addr, len));
+			break;
+		case S_CMD_Q_PERF:
+			len = RECEIVE();
+			SEND(S_ACK);
+			uart_perf_send(len);
+			flash_perf_send(len);
+			frser_send16(stack_unused());
+			break;
+		case S_CMD_Q_CHIPID: {
+			uint8_t mfr, dev, i;
+
+			i = flash_detect(&mfr, &dev);
+			SEND(S_ACK);
+			SEND(mfr);
+			SEND(dev);
+			SEND(i);
+			break;
+		}
+		case S_CMD_Q_CHIP:
+			len = RECEIVE();
+			if (len >= chip_count()) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			chip_send(len);
+			break;
+		case S_CMD_S_CHIP:
+			SEND(flash_set_chip(RECEIVE()) ? S_ACK : S_NAK);
+			break;
+		case S_CMD_S_ERASE:
+			// Done (0) or timed out (1), NAK if the chip in use can't
+			len = RECEIVE();
+			addr = frser_recv24();
+			if (len != FLASH_ERASE_SECTOR && len != FLASH_ERASE_CHIP)
+				len = FLASH_ERASE_NONE;
+			else
+				len = flash_erase(addr, len);
+			if (len == FLASH_ERASE_NONE) {
+				SEND(S_NAK);
+				break;
+			}
+			SEND(S_ACK);
+			SEND(len);
+			break;
+		default:
+			SEND(S_NAK);
+			break;
+		}
+	}
+}
@@ -0,0 +1,44 @@
+/* According to Serial Flasher Protocol Specification - version 1 */
+#define S_ACK 0x06
+#define S_NAK 0x15
+#define S_CMD_NOP		0x00	/* No operation					*/
+#define S_CMD_Q_IFACE		0x01	/* Query interface version			*/
+#define S_CMD_Q_CMDMAP		0x02	/* Query supported commands bitmap		*/
+#define S_CMD_Q_PGMNAME		0x03	/* Query programmer name			*/
+#define S_CMD_Q_SERBUF		0x04	/* Query Serial Buffer Size			*/
+#define S_CMD_Q_BUSTYPE		0x05	/* Query supported bustypes			*/
+#define S_CMD_Q_CHIPSIZE	0x06	/* Query supported chipsize (2^n format)	*/
+#define S_CMD_Q_OPBUF		0x07	/* Query operation buffer size			*/
+#define S_CMD_Q_WRNMAXLEN	0x08	/* Query Write to opbuf: Write-N maximum length */
+#define S_CMD_R_BYTE		0x09	/* Read a single byte				*/
+#define S_CMD_R_NBYTES		0x0A	/* Read n bytes					*/
+#define S_CMD_O_INIT		0x0B	/* Initialize operation buffer			*/
+#define S_CMD_O_WRITEB		0x0C	/* Write opbuf: Write byte with address		*/
+#define S_CMD_O_WRITEN		0x0D	/* Write to opbuf: Write-N			*/
+#define S_CMD_O_DELAY		0x0E	/* Write opbuf: udelay				*/
+#define S_CMD_O_EXEC		0x0F	/* Execute operation buffer			*/
+#define S_CMD_SYNCNOP		0x10	/* Special no-operation that returns NAK+ACK	*/
+#define S_CMD_Q_RDNMAXLEN	0x11	/* Query read-n maximum length			*/
+#define S_CMD_S_BUSTYPE		0x12	/* Set used bustype(s).				*/
+#define S_CMD_O_SPIOP		0x13	/* Perform SPI operation.			*/
+#define S_CMD_S_SPI_FREQ	0x14	/* Set SPI clock frequency			*/
+#define S_CMD_S_PIN_STATE	0x15	/* Enable/disable output drivers		*/
+#define S_CMD_O_RESET_SDP	0x19		/* Write to opbuf: reset SDP */
+#define S_CMD_O_SET_SDP		0x1A		/* Write to opbuf: set SDP */
+#define S_CMD_S_ERRORCNT_RESET		0x1B		/* Reset errors counter */
+#define S_CMD_Q_ERRORCNT		0x1C		/* Get number of writing errors */
+#define S_CMD_S_PAGESIZE		0x1D		/* Set Write-N page size */
+#define S_CMD_S_BAUD		0x1E		/* Set serial link speed */
+#define S_CMD_Q_BLANK		0x1F		/* Count non-blank bytes in a range */
+#define S_CMD_Q_CRC32		0x20		/* CRC-32 of a range */
+#define S_CMD_R_NBYTES_RLE	0x21		/* Read n bytes, RLE encoded stream */
+#define S_CMD_O_WRITEN_RLE	0x22		/* Write to opbuf: Write-N, RLE encoded payload */
+#define S_CMD_Q_PERF		0x23		/* Performance counters, arg: clear them after */
+#define S_CMD_Q_CHIPID		0x24		/* Software ID of the chip, uses its profile */
+#define S_CMD_Q_CHIP		0x25		/* Chip profile, arg: index */
+#define S_CMD_S_CHIP		0x26		/* Use a chip profile, arg: index */
+#define S_CMD_S_ERASE		0x27		/* Erase, args: what, 24-bit addr */
+#define S_CMD_R_NBYTES_VOTE	0x28		/* Read n bytes, majority of samples, args: 24-bit addr, 24-bit len, mode */
+
+#define S_IFACE_VERSION		0x01	/* Version of the protocol			*/
+#define S_BUS_PARALLEL		0x01	/* Bustype bits					*/
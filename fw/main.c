@@ -50,6 +50,41 @@ void reader(void);
 #include "flash.h"
 #include "frser.h"
 
+#ifdef __AVR__
+// RAM past the statics is painted at reset: what still holds the pattern
+// was never reached by the stack
+#define STACK_PAINT 0xC5
+extern uint8_t __heap_start;
+
+void stack_paint(void) __attribute__((naked, used, section(".init1")));
+void stack_paint(void) {
+	__asm volatile (
+		"	ldi r30, lo8(__heap_start)\n"
+		"	ldi r31, hi8(__heap_start)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(%1)\n"
+		"1:	cpi r30, lo8(%1)\n"
+		"	cpc r31, r25\n"
+		"	brsh 2f\n"
+		"	st Z+, r24\n"
+		"	rjmp 1b\n"
+		"2:\n"
+		:: "M" (STACK_PAINT), "i" (RAMEND));
+}
+
+uint16_t stack_unused(void) {
+	const uint8_t* p = &__heap_start;
+
+	while (p < (const uint8_t*)RAMEND && *p == STACK_PAINT)
+		p++;
+	return p - &__heap_start;
+}
+#else
+// The simulator runs on the host stack
+uint16_t stack_unused(void) {
+	return 0xFFFF;
+}
+#endif
 
 int main(void) {
 	cli();
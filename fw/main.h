@@ -33,3 +33,5 @@
 #include <string.h>
 #include <stdlib.h>
 #include <alloca.h>
+
+uint16_t stack_unused(void);
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "main.h"
+#include "uart.h"
+#include "rle.h"
+
+// Pending run: rle_run times rle_byte
+static uint8_t rle_byte;
+static uint8_t rle_run;
+
+static void rle_emit(void) {
+	if (rle_run >= RLE_MIN_RUN || rle_byte == RLE_ESC) {
+		SEND(RLE_ESC);
+		SEND(rle_run);
+		SEND(rle_byte);
+	} else {
+		do {
+			SEND(rle_byte);
+		} while (--rle_run);
+	}
+	rle_run = 0;
+}
+
+void rle_send_init(void) {
+	rle_run = 0;
+}
+
+void rle_send(uint8_t c) {
+	if (rle_run && (c != rle_byte || rle_run == 255))
+		rle_emit();
+	rle_byte = c;
+	rle_run++;
+}
+
+void rle_send_flush(void) {
+	if (rle_run)
+		rle_emit();
+}
+
+// Expand the stream coming from the UART into dst, until len bytes are
+// produced. The whole stream is taken in any case, so that the link stays
+// in sync: dst NULL drops it. Returns 0 if a run would overflow dst.
+uint8_t rle_recv(uint8_t* dst, uint32_t len) {
+	uint8_t ok = 1;
+
+	while (len) {
+		uint8_t c = RECEIVE();
+		uint8_t n = 1;
+
+		if (c == RLE_ESC) {
+			n = RECEIVE();
+			c = RECEIVE();
+			if (!n || n > len) {
+				// The encoder ends its stream on len, so does this
+				ok = 0;
+				dst = NULL;
+				if (!n)
+					continue;
+				n = len;
+			}
+		}
+
+		len -= n;
+		if (!dst)
+			continue;
+		do {
+			*dst++ = c;
+		} while (--n);
+	}
+	return ok;
+}
@@ -0,0 +1,27 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* RLE STREAM CODEC HEADER */
+/* Bytes are sent as they are, except for runs and for RLE_ESC itself:
+ * they become RLE_ESC, count (1-255), byte. No buffer needed on either end. */
+#define RLE_ESC 0xA5
+#define RLE_MIN_RUN 4
+void rle_send_init(void);
+void rle_send(uint8_t c);
+void rle_send_flush(void);
+uint8_t rle_recv(uint8_t* dst, uint32_t len);
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* SIMULATOR: EEPROM */
+#ifndef _SIM_AVR_EEPROM_H_
+#define _SIM_AVR_EEPROM_H_
+#include <stdint.h>
+
+// EEMEM variables live in RAM, they don't survive a restart
+#define EEMEM
+#define eeprom_read_byte(p) (*(const uint8_t*)(p))
+#define eeprom_read_word(p) (*(const uint16_t*)(p))
+#define eeprom_write_byte(p, v) (*(uint8_t*)(p) = (v))
+#define eeprom_write_word(p, v) (*(uint16_t*)(p) = (v))
+#define eeprom_update_byte eeprom_write_byte
+#define eeprom_update_word eeprom_write_word
+
+#endif
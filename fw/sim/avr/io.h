@@ -0,0 +1,77 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* SIMULATOR: ATmega328 REGISTERS */
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+#include <stdint.h>
+#include "sim.h"
+
+#define _BV(bit) (1 << (bit))
+
+// Every access to the ports goes through the chip model
+#define PINB (*sim_io(SIM_PINB))
+#define DDRB (*sim_io(SIM_DDRB))
+#define PORTB (*sim_io(SIM_PORTB))
+#define PINC (*sim_io(SIM_PINC))
+#define DDRC (*sim_io(SIM_DDRC))
+#define PORTC (*sim_io(SIM_PORTC))
+#define PIND (*sim_io(SIM_PIND))
+#define DDRD (*sim_io(SIM_DDRD))
+#define PORTD (*sim_io(SIM_PORTD))
+
+// USART0, serviced by the simulator threads
+#define UDR0 sim_udr0
+#define UCSR0A sim_ucsr0a
+#define UCSR0B sim_ucsr0b
+#define UCSR0C sim_ucsr0c
+#define UBRR0H sim_ubrr0h
+#define UBRR0L sim_ubrr0l
+
+#define MPCM0 0
+#define U2X0 1
+#define U2X U2X0
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+// Timer1, counting the simulated clock
+#define TCCR1A sim_tccr1a
+#define TCCR1B sim_tccr1b
+#define TCNT1 sim_tcnt1()
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+
+#define RAMSTART 0x100
+#define RAMEND 0x8FF
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* SIMULATOR: SLEEP MODES */
+#ifndef _SIM_AVR_SLEEP_H_
+#define _SIM_AVR_SLEEP_H_
+#include "sim.h"
+
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode) do { (void)(mode); } while (0)
+#define sleep_enable() do { } while (0)
+#define sleep_disable() do { } while (0)
+// Wait for the next interrupt
+#define sleep_cpu() sim_sleep()
+#define sleep_mode() sim_sleep()
+
+#endif
@@ -0,0 +1,797 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+/* SIMULATOR: ATMEGA328 PORTS, USART AND A 28Cxxx/27Cxxx IN THE SOCKET */
+/* The firmware is built for the host against the headers in this directory.
+ * Port accesses drive a model of the ÜRP board: 74HC595 address chain, A16,
+ * control lines, data bus and the chip. USART0 is served by two threads and
+ * shows up as a pseudo-terminal, paced at the baud rate the firmware set. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "avr/io.h"
+
+#define F_CPU 16000000UL
+// An in/out/sbi/cbi costs one or two cycles
+#define SIM_IO_NS 125
+// How far the simulated clock may run ahead of the real one
+#define SIM_AHEAD_NS 1000000
+// Pacing granularity of the serial threads
+#define SIM_PACE_NS 200000
+// Page load window: the chip starts programming when no byte comes for tBLC
+#define SIM_TBLC_NS 150000
+// NOR flash byte program, sector and chip erase (SST39SF010A, typical)
+#define SIM_TBP_NS 14000
+#define SIM_TSE_NS 18000000
+#define SIM_TSCE_NS 70000000
+// EEPROM software chip erase
+#define SIM_TEC_NS 20000000
+// Time spent in the bootloader after a reset
+#define SIM_BOOT_NS 1000000000ULL
+
+// Built from main.c with -Dmain=fw_main
+int fw_main(void);
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+
+typedef struct _chip_model {
+	const char* name;
+	uint32_t size;
+	uint16_t page;		// 0 when not electrically writable
+	uint8_t mfr, dev;	// Software ID, 0 when the chip has none
+	uint32_t sector;	// NOR flash erase sector, 0 for EEPROMs
+} chip_model;
+
+static const chip_model chips[] = {
+	{ "28c256", 0x8000, 64, 0, 0, 0 },
+	{ "28c64", 0x2000, 32, 0, 0, 0 },
+	{ "29ee010", 0x20000, 128, 0xBF, 0x07, 0 },
+	{ "39sf010a", 0x20000, 1, 0xBF, 0xB5, 0x1000 },
+	{ "27c256", 0x8000, 0, 0, 0, 0 },
+	{ "27c512", 0x10000, 0, 0, 0, 0 },
+};
+
+// Software data protection command sequences (address, data)
+static const uint16_t sdp_seq[6][2] = {
+	{ 0x5555, 0xAA }, { 0x2AAA, 0x55 }, { 0x5555, 0x80 },
+	{ 0x5555, 0xAA }, { 0x2AAA, 0x55 }, { 0x5555, 0x20 },
+};
+#define SDP_ENABLE 0xA0
+// Last byte of the chip erase sequence, instead of the SDP disable one
+#define CHIP_ERASE 0x10
+// Third byte of the software ID entry and exit sequences
+#define ID_ENTRY 0x90
+#define ID_EXIT 0xF0
+
+volatile uint8_t sim_udr0, sim_ucsr0a = _BV(UDRE0), sim_ucsr0b, sim_ucsr0c;
+static uint8_t txc;			// TXC0: last frame out, nothing in UDR0
+volatile uint8_t sim_ubrr0h, sim_ubrr0l;
+volatile uint8_t sim_tccr1a, sim_tccr1b;
+
+static volatile uint8_t regs[SIM_NREGS];
+static uint8_t seen[SIM_NREGS];		// Registers as last applied to the model
+
+static const chip_model* chip = &chips[0];
+static uint8_t* mem;
+static uint64_t twc_ns = 10000000;	// Datasheet maximum
+static int32_t weak = -1;		// Byte with a weak bit 0, -1 if none
+
+static struct {
+	uint16_t sr, latch;		// 74HC595 chain: shift and storage registers
+	uint8_t powered;
+	// Page being loaded
+	uint8_t loading;
+	uint64_t loaded_ns;		// Last byte loaded
+	uint32_t page_addr;
+	uint8_t buf[256];
+	uint8_t mask[256];
+	// Programming
+	uint8_t busy;
+	uint64_t busy_until;
+	uint8_t last;			// Last byte loaded, for data polling
+	uint8_t toggle;			// DQ6 toggles on every read while busy
+	// Software data protection
+	uint8_t protect;
+	uint8_t unlocked;		// Enable sequence seen in this load
+	uint8_t seq;
+	uint16_t held[6];
+	uint8_t id;			// Software ID mode
+	uint8_t nor;			// NOR flash command cycle
+} c;
+
+static struct {
+	uint32_t rx, tx, rx_lost;
+	uint32_t programs, bytes, ignored, blocked, page_cross, contention;
+} stats;
+
+static int pty;
+static uint64_t t0;
+static uint64_t sim_ns;		// Simulated clock, main thread only
+
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_cond = PTHREAD_COND_INITIALIZER;
+// Global interrupt flag. While it is clear the main thread holds irq_lock.
+static uint8_t ie;
+static uint32_t irq_seq, irq_seen;
+
+// SW1 was pressed, the main thread goes back to boot
+static volatile uint8_t reset;
+static jmp_buf boot;
+
+static uint64_t real_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - t0;
+}
+
+static void sleep_until(uint64_t ns) {
+	struct timespec ts;
+
+	ns += t0;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// The MCU may not run more than SIM_AHEAD_NS ahead of real time. It never
+// catches up while busy: being preempted must not make a tBLC expire.
+static void sim_tick(uint64_t ns) {
+	const uint64_t now = real_ns();
+
+	sim_ns += ns;
+	if (sim_ns > now + SIM_AHEAD_NS)
+		sleep_until(sim_ns - SIM_AHEAD_NS / 2);
+}
+
+static uint32_t chip_addr(void) {
+	uint32_t addr = c.latch;
+
+	if (seen[SIM_PORTB] & _BV(5))
+		addr |= 0x10000;
+	return addr % chip->size;
+}
+
+// Commit the page once its write cycle is over
+static void chip_update(void) {
+	if (c.loading && sim_ns >= c.loaded_ns + SIM_TBLC_NS) {
+		c.loading = 0;
+		c.busy = 1;
+		c.busy_until = c.loaded_ns + SIM_TBLC_NS + twc_ns;
+	}
+
+	if (c.busy && sim_ns >= c.busy_until) {
+		for (uint16_t i = 0; i < chip->page; i++) {
+			if (!c.mask[i])
+				continue;
+			mem[c.page_addr + i] = c.buf[i];
+			stats.bytes++;
+		}
+		memset(c.mask, 0, sizeof(c.mask));
+		c.busy = 0;
+		c.unlocked = 0;
+		stats.programs++;
+	}
+}
+
+// A read ends the page load, programming starts right away
+static void chip_start(void) {
+	chip_update();
+	if (c.loading) {
+		c.loaded_ns = sim_ns - SIM_TBLC_NS;
+		chip_update();
+	}
+}
+
+static void chip_load(uint32_t addr, uint8_t data) {
+	const uint32_t page_addr = addr & ~(uint32_t)(chip->page - 1);
+
+	// A6 and up must not change within a load: the chip takes the page of
+	// the last byte
+	if (c.loading && page_addr != c.page_addr) {
+		stats.page_cross++;
+		fprintf(stderr, "sim: page load crosses from %05x to %05x\n",
+			c.page_addr, page_addr);
+	}
+
+	c.page_addr = page_addr;
+	c.buf[addr - page_addr] = data;
+	c.mask[addr - page_addr] = 1;
+	c.last = data;
+	c.loading = 1;
+	c.loaded_ns = sim_ns;
+}
+
+// NOR flash: every program or erase comes with its command sequence. The
+// memory changes right away, reads show the status until the time is over.
+static void nor_write(uint32_t addr, uint8_t data) {
+	const uint16_t a = addr & 0x7FFF;
+	uint64_t t;
+
+	if (c.nor == 3) {
+		mem[addr] &= data;	// Bits only go from 1 to 0
+		c.last = data;
+		t = SIM_TBP_NS;
+		stats.bytes++;
+	} else if (c.nor == 6 && data == 0x30) {
+		memset(mem + (addr & ~(chip->sector - 1)), 0xFF, chip->sector);
+		c.last = 0xFF;
+		t = SIM_TSE_NS;
+	} else if (c.nor == 6 && a == 0x5555 && data == 0x10) {
+		memset(mem, 0xFF, chip->size);
+		c.last = 0xFF;
+		t = SIM_TSCE_NS;
+	} else if ((c.nor == 0 || c.nor == 4) && a == 0x5555 && data == 0xAA) {
+		c.nor++;
+		return;
+	} else if ((c.nor == 1 || c.nor == 5) && a == 0x2AAA && data == 0x55) {
+		c.nor++;
+		return;
+	} else if (c.nor == 2 && a == 0x5555 && (data == 0xA0 || data == 0x80)) {
+		c.nor = data == 0xA0 ? 3 : 4;
+		return;
+	} else if ((c.nor == 2 && a == 0x5555 && data == ID_ENTRY) || data == ID_EXIT) {
+		c.id = data == ID_ENTRY;
+		c.nor = 0;
+		return;
+	} else {
+		stats.ignored++;
+		c.nor = 0;
+		return;
+	}
+
+	c.nor = 0;
+	c.busy = 1;
+	c.busy_until = sim_ns + t;
+}
+
+// Sequence bytes are kept aside: if the sequence breaks they were data
+static void chip_write(uint32_t addr, uint8_t data) {
+	const uint16_t a = addr & 0x7FFF;
+
+	chip_update();
+
+	if (!chip->page || c.busy) {
+		stats.ignored++;
+		return;
+	}
+
+	if (chip->sector) {
+		nor_write(addr, data);
+		return;
+	}
+
+	if (chip->mfr && c.seq == 2 && a == 0x5555 &&
+	    (data == ID_ENTRY || data == ID_EXIT)) {
+		c.id = data == ID_ENTRY;
+		c.seq = 0;
+		c.loading = 0;
+		return;
+	}
+
+	if (c.seq == 2 && a == 0x5555 && data == SDP_ENABLE) {
+		c.protect = 1;
+		c.unlocked = 1;
+		c.seq = 0;
+		c.loading = 1;
+		c.loaded_ns = sim_ns;
+		return;
+	}
+
+	if (c.seq == 5 && a == 0x5555 && data == CHIP_ERASE) {
+		memset(mem, 0xFF, chip->size);
+		memset(c.mask, 0, sizeof(c.mask));
+		c.seq = 0;
+		c.loading = 0;
+		c.last = 0xFF;
+		c.busy = 1;
+		c.busy_until = sim_ns + SIM_TEC_NS;
+		return;
+	}
+
+	if (a == sdp_seq[c.seq][0] && data == sdp_seq[c.seq][1]) {
+		c.held[c.seq++] = addr;
+		c.loading = 1;
+		c.loaded_ns = sim_ns;
+		if (c.seq == 6) {
+			c.protect = 0;
+			c.seq = 0;
+		}
+		return;
+	}
+
+	for (uint8_t i = 0; i < c.seq; i++) {
+		if (!c.protect || c.unlocked)
+			chip_load(c.held[i], sdp_seq[i][1]);
+	}
+	c.seq = 0;
+
+	if (c.protect && !c.unlocked) {
+		stats.blocked++;
+		return;
+	}
+
+	chip_load(addr, data);
+}
+
+static void chip_power(uint8_t on) {
+	if (!on && (c.loading || c.busy))
+		fprintf(stderr, "sim: power removed during a write cycle\n");
+
+	memset(c.mask, 0, sizeof(c.mask));
+	c.loading = 0;
+	c.busy = 0;
+	c.seq = 0;
+	c.unlocked = 0;
+	c.id = 0;
+	c.nor = 0;
+	c.powered = on;
+}
+
+// Data the chip drives on the bus, -1 when it doesn't
+static int chip_output(void) {
+	const uint8_t pd = seen[SIM_PORTD];
+
+	if (!c.powered || (pd & _BV(3)) || (pd & _BV(4)) || !(pd & _BV(2)))
+		return -1;
+
+	chip_update();
+	if (c.busy)
+		return (~c.last & 0x80) | (c.toggle ? 0x40 : 0) | (c.last & 0x3F);
+	if (c.id)
+		return chip_addr() & 1 ? chip->dev : chip->mfr;
+
+	// A weak bit reads wrong one access out of four
+	if ((int32_t)chip_addr() == weak && !(rand() & 3))
+		return mem[chip_addr()] ^ 0x01;
+	return mem[chip_addr()];
+}
+
+// Apply what changed on the ports since the last access
+static void sim_sync(void) {
+	const uint8_t pb = regs[SIM_PORTB], pd = regs[SIM_PORTD];
+	const uint8_t up = pd & ~seen[SIM_PORTD];
+	const uint8_t down = ~pd & seen[SIM_PORTD];
+
+	for (uint8_t r = 0; r < SIM_NREGS; r++)
+		seen[r] = regs[r];
+
+	// PB4 drives the socket supply PMOS, active low
+	const uint8_t powered = !(pb & _BV(4)) && (regs[SIM_DDRB] & _BV(4));
+	if (powered != c.powered)
+		chip_power(powered);
+
+	// Shift clock on PD5, data on PD7, latch on PD6
+	if (up & _BV(5))
+		c.sr = (c.sr << 1) | ((pd >> 7) & 1);
+	if (up & _BV(6))
+		c.latch = c.sr;
+
+	// ~OE falling: a new read
+	if (down & _BV(4) && c.powered) {
+		chip_start();
+		c.toggle ^= c.busy;
+	}
+
+	// ~WE rising with ~CE low and ~OE high latches the data
+	if (up & _BV(2) && c.powered && !(pd & _BV(3)) && (pd & _BV(4))) {
+		const uint8_t data = (seen[SIM_PORTB] & 0x0F) | (seen[SIM_PORTC] & 0x0F) << 4;
+
+		chip_write(chip_addr(), data);
+	}
+}
+
+// Pins read back what the MCU drives, the chip output on the data bus, or
+// the pull-ups
+static void sim_pins(void) {
+	const int out = chip_output();
+	const uint8_t ddr_data = (regs[SIM_DDRB] & 0x0F) | (regs[SIM_DDRC] & 0x0F) << 4;
+	uint8_t bus = out < 0 ? 0xFF : out;
+
+	if (out >= 0 && ddr_data)
+		stats.contention++;
+
+	for (uint8_t r = SIM_PINB; r < SIM_NREGS; r += 3) {
+		const uint8_t ddr = regs[r + 1], port = regs[r + 2];
+		uint8_t ext = 0xFF;
+
+		if (r == SIM_PINB)
+			ext = (ext & 0xF0) | (bus & 0x0F);
+		else if (r == SIM_PINC)
+			ext = (ext & 0xF0) | (bus >> 4);
+		// Floating inputs without pull-up read as ones too
+		regs[r] = (port & ddr) | (ext & ~ddr);
+	}
+}
+
+// SW1: registers go back to their reset values, which powers the socket
+// down, then the bootloader keeps the USART off for a while. Unlike on the
+// MCU, globals keep their values: the firmware has to initialize what it uses.
+static void sim_reset(void) {
+	reset = 0;
+	fprintf(stderr, "sim: reset\n");
+
+	if (ie) {
+		pthread_mutex_lock(&irq_lock);
+		ie = 0;
+	}
+	memset((void*)regs, 0, sizeof(regs));
+	sim_ucsr0a = _BV(UDRE0);
+	txc = 0;
+	sim_ucsr0b = 0;
+	sim_ucsr0c = 0x06;
+	sim_ubrr0h = sim_ubrr0l = 0;
+	sim_tccr1a = sim_tccr1b = 0;
+	sim_sync();
+
+	pthread_mutex_unlock(&irq_lock);
+	sleep_until(real_ns() + SIM_BOOT_NS);
+	pthread_mutex_lock(&irq_lock);
+	sim_ns = real_ns();
+
+	longjmp(boot, 1);
+}
+
+volatile uint8_t* sim_io(uint8_t reg) {
+	if (reset)
+		sim_reset();
+	sim_sync();
+	sim_tick(SIM_IO_NS);
+	if (reg == SIM_PINB || reg == SIM_PINC || reg == SIM_PIND)
+		sim_pins();
+	return &regs[reg];
+}
+
+uint16_t sim_tcnt1(void) {
+	static const uint16_t prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	const uint16_t div = prescaler[sim_tccr1b & 7];
+
+	// Port writes are applied on the next access, this is one
+	sim_sync();
+	sim_tick(SIM_IO_NS);
+	return div ? sim_ns * (F_CPU / 1000000) / 1000 / div : 0;
+}
+
+void sim_delay_ns(uint64_t ns) {
+	if (reset)
+		sim_reset();
+	sim_sync();
+	sim_tick(ns);
+	chip_update();
+}
+
+void sim_cli(void) {
+	if (!ie)
+		return;
+	pthread_mutex_lock(&irq_lock);
+	ie = 0;
+}
+
+void sim_sei(void) {
+	if (ie)
+		return;
+	irq_seen = irq_seq;
+	ie = 1;
+	pthread_mutex_unlock(&irq_lock);
+}
+
+uint8_t sim_ie(void) {
+	return ie;
+}
+
+// Like the AVR, the instruction after sei() runs before any interrupt:
+// irq_seen tells whether one came in since then
+void sim_sleep(void) {
+	pthread_mutex_lock(&irq_lock);
+	while (irq_seq == irq_seen)
+		pthread_cond_wait(&irq_cond, &irq_lock);
+	irq_seen = irq_seq;
+	pthread_mutex_unlock(&irq_lock);
+	if (reset)
+		sim_reset();
+
+	// Time went by while idle
+	const uint64_t now = real_ns();
+	if (sim_ns < now)
+		sim_ns = now;
+}
+
+static void irq_done(void) {
+	irq_seq++;
+	pthread_cond_broadcast(&irq_cond);
+}
+
+static uint64_t byte_ns(void) {
+	const uint32_t ubrr = (sim_ubrr0h << 8 | sim_ubrr0l) + 1;
+	const uint32_t div = sim_ucsr0a & _BV(U2X0) ? 8 : 16;
+
+	// Start, 8 data bits, stop
+	return 10ULL * 1000000000 * div * ubrr / F_CPU;
+}
+
+// Next byte may go at *slot, sleep only when well ahead of it
+static void pace(uint64_t* slot) {
+	const uint64_t now = real_ns();
+
+	if (*slot < now)
+		*slot = now;
+	*slot += byte_ns();
+	if (*slot > now + SIM_PACE_NS)
+		sleep_until(*slot);
+}
+
+static void* sim_rx(void* arg) {
+	uint8_t buf[256];
+	uint64_t slot = 0;
+	(void)arg;
+
+	for (;;) {
+		const ssize_t n = read(pty, buf, sizeof(buf));
+
+		if (n <= 0) {
+			usleep(1000);
+			continue;
+		}
+
+		for (ssize_t i = 0; i < n; i++) {
+			pace(&slot);
+			pthread_mutex_lock(&irq_lock);
+			if (sim_ucsr0b & _BV(RXCIE0)) {
+				sim_udr0 = buf[i];
+				USART_RX_vect();
+				irq_done();
+				stats.rx++;
+			} else {
+				stats.rx_lost++;
+			}
+			pthread_mutex_unlock(&irq_lock);
+		}
+	}
+	return NULL;
+}
+
+static void* sim_tx(void* arg) {
+	uint8_t buf[256];
+	uint16_t len = 0;
+	uint64_t slot = 0;
+	(void)arg;
+
+	for (;;) {
+		uint8_t sent = 0;
+
+		pthread_mutex_lock(&irq_lock);
+		if (sim_ucsr0b & _BV(UDRIE0)) {
+			// TXC0 is cleared by writing a one: see if the vector does
+			sim_ucsr0a &= ~_BV(TXC0);
+			USART_UDRE_vect();
+			irq_done();
+			if (sim_ucsr0a & _BV(TXC0))
+				txc = 0;
+			// The vector turns itself off when there is nothing to send
+			sent = !!(sim_ucsr0b & _BV(UDRIE0));
+			if (sent)
+				buf[len++] = sim_udr0;
+		}
+		// Shift register is empty once the time of the last frame is over
+		if (!sent && real_ns() >= slot)
+			txc = 1;
+		if (txc)
+			sim_ucsr0a |= _BV(TXC0);
+		else
+			sim_ucsr0a &= ~_BV(TXC0);
+		pthread_mutex_unlock(&irq_lock);
+
+		if (len && (!sent || len == sizeof(buf) || slot + byte_ns() > real_ns() + SIM_PACE_NS)) {
+			if (write(pty, buf, len) == len)
+				stats.tx += len;
+			len = 0;
+		}
+
+		if (sent)
+			pace(&slot);
+		else
+			usleep(20);
+	}
+	return NULL;
+}
+
+// The firmware busy waits on the USART: on a single core the serial
+// threads must preempt it, as interrupts would. Best effort, it needs
+// privileges.
+static void sim_realtime(pthread_t thread) {
+	const struct sched_param param = { .sched_priority = 1 };
+
+	pthread_setschedparam(thread, SCHED_FIFO, &param);
+}
+
+static void* sim_signals(void* arg) {
+	sigset_t* set = arg;
+	int sig;
+
+	while (sigwait(set, &sig) == 0 && sig == SIGUSR1) {
+		reset = 1;
+		// Wake up the MCU if it sleeps
+		pthread_mutex_lock(&irq_lock);
+		irq_done();
+		pthread_mutex_unlock(&irq_lock);
+	}
+
+	if (mem)
+		msync(mem, chip->size, MS_SYNC);
+	fprintf(stderr, "\nsim: %u bytes received (%u lost), %u sent\n",
+		stats.rx, stats.rx_lost, stats.tx);
+	fprintf(stderr, "sim: %u write cycles, %u bytes programmed, %u writes ignored while busy,"
+		" %u blocked by SDP, %u page crossings, %u bus contentions\n",
+		stats.programs, stats.bytes, stats.ignored, stats.blocked,
+		stats.page_cross, stats.contention);
+	exit(0);
+}
+
+static uint8_t* map_image(const char* path) {
+	struct stat st;
+	uint8_t* m;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((uint32_t)st.st_size < chip->size && ftruncate(fd, chip->size) < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	m = mmap(NULL, chip->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+
+	// New or grown file: the rest of the chip is erased
+	if ((uint32_t)st.st_size < chip->size)
+		memset(m + st.st_size, 0xFF, chip->size - st.st_size);
+
+	return m;
+}
+
+static int open_pty(const char* link) {
+	struct termios tty;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("pty");
+		exit(1);
+	}
+
+	// Keep the other side open and raw: no echo before serprog configures
+	// it, and no hangup when serprog exits
+	int slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tty) < 0) {
+		perror(ptsname(fd));
+		exit(1);
+	}
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+
+	if (link) {
+		unlink(link);
+		if (symlink(ptsname(fd), link) < 0) {
+			perror(link);
+			exit(1);
+		}
+	}
+
+	return fd;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [options]\n\n"
+		" -c chip    chip in the socket (28c256, 28c64, 29ee010, 39sf010a,\n"
+		"            27c256, 27c512)\n"
+		" -i file    chip content, kept in file (default: blank, not saved)\n"
+		" -t us      write cycle time (default 10000)\n"
+		" -p         software data protection enabled at start\n"
+		" -w addr    bit 0 of the byte at addr is weak, reads flip at random\n"
+		" -l path    symlink to the pseudo-terminal\n"
+		"\nSIGUSR1 presses SW1 (reset).\n", name);
+	exit(1);
+}
+
+#undef main
+int main(int argc, char* argv[]) {
+	const char* image = NULL;
+	const char* link = NULL;
+	pthread_t thread;
+	sigset_t set;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:i:t:pw:l:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			chip = NULL;
+			for (size_t i = 0; i < sizeof(chips) / sizeof(*chips); i++)
+				if (!strcasecmp(optarg, chips[i].name))
+					chip = &chips[i];
+			if (!chip)
+				usage(argv[0]);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 't':
+			twc_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'p':
+			c.protect = 1;
+			break;
+		case 'w':
+			weak = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (image) {
+		mem = map_image(image);
+	} else {
+		mem = malloc(chip->size);
+		memset(mem, 0xFF, chip->size);
+	}
+
+	pty = open_pty(link);
+	fprintf(stderr, "sim: %s on %s, tWC %u us%s\n", chip->name, ptsname(pty),
+		(unsigned)(twc_ns / 1000), c.protect ? ", SDP enabled" : "");
+
+	t0 = real_ns();
+
+	// Out of reset, interrupts are off
+	pthread_mutex_lock(&irq_lock);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_create(&thread, NULL, sim_signals, &set);
+	pthread_create(&thread, NULL, sim_rx, NULL);
+	sim_realtime(thread);
+	pthread_create(&thread, NULL, sim_tx, NULL);
+	sim_realtime(thread);
+
+	// SW1 starts over from here
+	setjmp(boot);
+	return fw_main();
+}
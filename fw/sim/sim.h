@@ -0,0 +1,42 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+/* SIMULATOR: INTERFACE FOR THE MOCKED AVR HEADERS */
+#ifndef _SIM_H_
+#define _SIM_H_
+#include <stdint.h>
+
+enum {
+	SIM_PINB, SIM_DDRB, SIM_PORTB,
+	SIM_PINC, SIM_DDRC, SIM_PORTC,
+	SIM_PIND, SIM_DDRD, SIM_PORTD,
+	SIM_NREGS
+};
+
+volatile uint8_t* sim_io(uint8_t reg);
+void sim_delay_ns(uint64_t ns);
+void sim_cli(void);
+void sim_sei(void);
+uint8_t sim_ie(void);
+void sim_sleep(void);
+
+extern volatile uint8_t sim_udr0, sim_ucsr0a, sim_ucsr0b, sim_ucsr0c;
+extern volatile uint8_t sim_ubrr0h, sim_ubrr0l;
+extern volatile uint8_t sim_tccr1a, sim_tccr1b;
+uint16_t sim_tcnt1(void);
+
+#endif
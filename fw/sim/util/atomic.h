@@ -0,0 +1,33 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* SIMULATOR: ATOMIC BLOCKS */
+#ifndef _SIM_UTIL_ATOMIC_H_
+#define _SIM_UTIL_ATOMIC_H_
+#include <stdint.h>
+#include "sim.h"
+
+#define ATOMIC_RESTORESTATE sim_ie()
+#define ATOMIC_FORCEON 1
+
+// Interrupts off for the block, then back on if type says so
+#define ATOMIC_BLOCK(type) \
+	for (uint8_t sim_restore = (type), sim_once = (sim_cli(), 1); sim_once; \
+	     sim_once = 0, sim_restore ? sim_sei() : (void)0)
+
+#endif
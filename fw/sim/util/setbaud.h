@@ -0,0 +1,25 @@
+/*
+ * This file is part of the frser-avr project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* SIMULATOR: BAUD RATE CALCULATION */
+/* Same results as avr-libc for the rates used here. No include guard: it is
+ * meant to be included where F_CPU and BAUD are defined. */
+#define UBRR_VALUE ((((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD))) - 1UL)
+#define UBRRL_VALUE (UBRR_VALUE & 0xFF)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define USE_2X 0
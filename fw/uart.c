@@ -20,22 +20,39 @@
 
 #include "main.h"
 #include "uart.h"
+#include "frser-cfg.h"
 
 // UART MODULE START
-typedef uint8_t urxbufoff_t;
+// The RX ring is larger than 256 bytes: the ISR updates the write index in
+// two stores, so the main loop reads it with interrupts off
+typedef uint16_t urxbufoff_t;
 typedef uint8_t utxbufoff_t;
 uint8_t volatile uart_rcvbuf[UART_BUFLEN];
 urxbufoff_t volatile uart_rcvwptr;
 urxbufoff_t uart_rcvrptr;
 
 unsigned char volatile uart_sndbuf[UARTTX_BUFLEN];
+// UBRR values for the negotiable rates, with U2X at 16 MHz:
+// 38400, 115200, 500k, 1M, 2M
+static const uint8_t uart_baud_ubrr[] PROGMEM = { 51, 16, 3, 1, 0 };
 utxbufoff_t volatile uart_sndwptr;
 utxbufoff_t volatile uart_sndrptr;
 
+// Performance counters, sent by uart_perf_send()
+static uint16_t uart_rx_high;		// Most bytes seen waiting in the RX ring
+static uint16_t volatile uart_rx_overruns;	// Bytes lost: ISR too late, or ring full
+static uint16_t uart_tx_stalls;		// uart_send() had to wait for room
+
 ISR(USART_RX_vect) {
 	urxbufoff_t reg = uart_rcvwptr;
+	if (UCSR0A & _BV(DOR0)) uart_rx_overruns++;
 	uart_rcvbuf[reg++] = UDR0;
 	if(reg==UART_BUFLEN) reg = 0;
+	// Full: drop this byte, not the whole ring
+	if (reg == uart_rcvrptr) {
+		uart_rx_overruns++;
+		return;
+	}
 	uart_rcvwptr = reg;
 }
 
@@ -43,6 +60,8 @@ ISR(USART_RX_vect) {
 ISR(USART_UDRE_vect) {
 	utxbufoff_t reg = uart_sndrptr;
 	if (uart_sndwptr != reg) {
+		// TXC0 (cleared by writing a one) tells when this frame is out
+		UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
 		UDR0 = uart_sndbuf[reg++];
 		if (reg==UARTTX_BUFLEN) reg = 0;
 		uart_sndrptr = reg;
@@ -54,8 +73,16 @@ ISR(USART_UDRE_vect) {
 }
 
 
+static urxbufoff_t uart_rcvwptr_get(void) {
+	urxbufoff_t reg;
+	cli();
+	reg = uart_rcvwptr;
+	sei();
+	return reg;
+}
+
 unsigned char uart_isdata(void) {
-	if (uart_rcvwptr != uart_rcvrptr) {  return 1; }
+	if (uart_rcvwptr_get() != uart_rcvrptr) {  return 1; }
 	else { return 0; }
 }
 
@@ -71,26 +98,34 @@ static void uart_sleep(void) {
 }
 
 unsigned char uart_recv(void) {
-	urxbufoff_t reg;
+	urxbufoff_t reg, wptr;
 	unsigned char val;
-	while (!uart_isdata()) uart_sleep(); // when there's nothing to do, one might idle...
+	while ((wptr = uart_rcvwptr_get()) == uart_rcvrptr) uart_sleep(); // when there's nothing to do, one might idle...
+	reg = wptr - uart_rcvrptr;
+	if (wptr < uart_rcvrptr) reg += UART_BUFLEN;
+	if (reg > uart_rx_high) uart_rx_high = reg;
 	reg = uart_rcvrptr;
 	val = uart_rcvbuf[reg++];
 	if(reg==UART_BUFLEN) reg = 0;
+	// The ISR compares against it
+	cli();
 	uart_rcvrptr = reg;
+	sei();
 	return val;
 }
 
+// Only the main loop moves the write pointer and only the ISR moves the read
+// pointer, both single byte stores: no need to block interrupts per byte
 void uart_send(unsigned char val) {
-	utxbufoff_t reg;
-	while (uart_sndwptr+1==uart_sndrptr || (uart_sndwptr+1==UARTTX_BUFLEN && !uart_sndrptr)); // wait for space in buf
-	cli();
-	reg = uart_sndwptr;
-	UCSR0B |= _BV(5); // make sure the transmit int is on
-	uart_sndbuf[reg++] = val; // add byte to the transmit queue
-	if(reg==UARTTX_BUFLEN) reg = 0;
+	utxbufoff_t reg = uart_sndwptr + 1;
+	if (reg==UARTTX_BUFLEN) reg = 0;
+	if (reg == uart_sndrptr) {
+		uart_tx_stalls++;
+		while (reg == uart_sndrptr); // wait for space in buf
+	}
+	uart_sndbuf[uart_sndwptr] = val; // add byte to the transmit queue
 	uart_sndwptr = reg;
-	sei();
+	UCSR0B |= _BV(5); // make sure the transmit int is on
 }
 
 void uart_init(void) {
@@ -118,3 +153,70 @@ void uart_init(void) {
 void uart_wait_txdone(void) {
 	while (uart_sndwptr != uart_sndrptr);
 }
+
+// Answer to S_CMD_Q_PERF, UART part: three 16-bit LE counters. Sent first,
+// before the answer itself stalls the TX ring.
+void uart_perf_send(uint8_t clear) {
+	uint16_t perf[3];
+
+	cli();
+	perf[0] = uart_rx_high;
+	perf[1] = uart_rx_overruns;
+	perf[2] = uart_tx_stalls;
+	if (clear) {
+		uart_rx_high = 0;
+		uart_rx_overruns = 0;
+		uart_tx_stalls = 0;
+	}
+	sei();
+
+	for (uint8_t i = 0; i < 3; i++) {
+		SEND(perf[i]);
+		SEND(perf[i] >> 8);
+	}
+}
+
+uint8_t uart_baud_supported(uint8_t code) {
+	return code < sizeof(uart_baud_ubrr);
+}
+
+// Caller has already sent the ACK at the current rate. The host must then
+// send UART_BAUD_CONFIRM at the new rate within ~200ms: it gets echoed back,
+// otherwise we silently return to the previous rate.
+void uart_switch_baud(uint8_t code) {
+	uint8_t ubrrh = UBRR0H;
+	uint8_t ubrrl = UBRR0L;
+	uint8_t u2x = UCSR0A & _BV(U2X0);
+
+	// Let the ACK leave the shift register at the old rate
+	uart_wait_txdone();
+	while (!(UCSR0A & _BV(TXC0)));
+
+	cli();
+	UBRR0H = 0;
+	UBRR0L = pgm_read_byte(&uart_baud_ubrr[code]);
+	UCSR0A |= _BV(U2X0);
+	sei();
+
+	// The host sends nothing but its confirmation after our ACK: anything
+	// else is noise from either end switching
+	for (uint8_t i = 200; i > 0; i--) {
+		while (uart_isdata()) {
+			if (uart_recv() == UART_BAUD_CONFIRM) {
+				SEND(UART_BAUD_CONFIRM);
+				return;
+			}
+		}
+		_delay_ms(1);
+	}
+
+	cli();
+	UBRR0H = ubrrh;
+	UBRR0L = ubrrl;
+	if (u2x)
+		UCSR0A |= _BV(U2X0);
+	else
+		UCSR0A &= ~_BV(U2X0);
+	uart_rcvrptr = uart_rcvwptr;
+	sei();
+}
@@ -24,8 +24,17 @@ unsigned char uart_recv(void);
 void uart_send(unsigned char val);
 void uart_init(void);
 void uart_wait_txdone(void);
+uint8_t uart_baud_supported(uint8_t code);
+void uart_switch_baud(uint8_t code);
+void uart_perf_send(uint8_t clear);
 #define BAUD 38400
+#define UART_BAUD_CONFIRM 0x55
 #define RECEIVE() uart_recv()
 #define SEND(n) uart_send(n)
-#define UART_BUFLEN 224
-#define UARTTX_BUFLEN 16
+// Covers the gaps while the next address is shifted out during reads
+#define UARTTX_BUFLEN 64
+// Holds the next opbuf worth of commands while the current one is executed,
+// so that the link and the chip work at the same time: the RAM left by the
+// TX ring and the system (FRSER_SYS_BYTES) is split evenly between the two,
+// 896 bytes each on the atmega328
+#define UART_BUFLEN ((RAMEND + 1 - RAMSTART - UARTTX_BUFLEN - FRSER_SYS_BYTES) / 2)
@@ -3,14 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <termios.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdarg.h>
-#include <setjmp.h>
 #include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include "serprog.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #define DEFAULT_DEVICE "/dev/ttyUSB0"
 
@@ -19,17 +23,22 @@ typedef int bool;
 #define false (0)
 #define true (1)
 
-static jmp_buf err;
+// Errors, returned as negative values all the way up to main
+#define E_IO      -1    // See errno
+#define E_TIMEOUT -2    // Programmer did not answer in time
+#define E_NAK     -3    // Programmer refused the command
+#define E_PROTO   -4    // Answer makes no sense
+#define E_VERIFY  -5    // Chip content differs from what was expected
 
 int config_serial(int fd, int speed, int parity) {
   int ret;
   struct termios tty;
 
   memset(&tty, 0, sizeof(tty));
-  
+
   ret = tcgetattr(fd, &tty);
   if (ret < 0)
-    longjmp(err, ret);
+    return E_IO;
 
   cfsetospeed(&tty, speed);
   cfsetispeed(&tty, speed);
@@ -46,7 +55,7 @@ int config_serial(int fd, int speed, int parity) {
   tty.c_lflag = 0;     // no signaling chars, no echo, no canonical processing
   tty.c_oflag = 0;     // no remapping, no delays
   tty.c_cc[VMIN] = 0;
-  tty.c_cc[VTIME] = 100;// ten seconds timeout
+  tty.c_cc[VTIME] = 0; // never block, timeouts are handled with poll()
   tty.c_cflag |= (CLOCAL | CREAD);    // ignore modem controls, enable reading
   tty.c_cflag &= ~(PARENB | PARODD);  // no parity by default
   tty.c_cflag |= parity;
@@ -54,331 +63,2420 @@ int config_serial(int fd, int speed, int parity) {
 
   ret = tcsetattr(fd, TCSANOW, &tty);
   if (ret < 0)
-    longjmp(err, ret);
+    return E_IO;
 
   return 0;
 }
 
-int init_serial(char const* path) {
-  int fd = open(path, O_RDWR | O_NOCTTY | O_SYNC);
-  if (fd < 0)
-    longjmp(err, fd);
-  
-  config_serial(fd, B38400, 0);
-    
-  return fd;
-}
+typedef struct _baudrate {
+  int rate;
+  speed_t speed;
+} baudrate;
+
+// Index is the rate code sent with S_CMD_S_BAUD
+static const baudrate baudrates[] = {
+  {  38400, B38400 },
+  { 115200, B115200 },
+  { 500000, B500000 },
+  {1000000, B1000000 },
+  {2000000, B2000000 },
+};
+
+#define DEFAULT_BAUD 0
 
 #define STDIN 0
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+// Received bytes wait here until someone asks for them. Answers that arrive
+// ahead of time (pipelined commands) are kept, never flushed.
+#define RX_RING 4096
+
+typedef struct _port {
+  int fd;
+  int baud;
+  uint8_t rx[RX_RING];
+  uint32_t head, tail;  // Free running, index modulo RX_RING
+  bool rle_read;        // Read with S_CMD_R_NBYTES_RLE
+  bool rle_write;       // Write with S_CMD_O_WRITEN_RLE when it saves link time
+  uint8_t cmdmap[32];   // Commands the programmer supports, from S_CMD_Q_CMDMAP
+} port;
+
+// Allowance on every deadline: USB serial adapters hold data up to their
+// latency timer, then the kernel has to schedule us
+#define SLACK_MS 250
+// Output may queue behind this much data written earlier
+#define TTY_TXBUF 4096
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Time to move bytes over the link, 10 bits each, plus busy_ms the
+// programmer needs to do the job
+static int port_budget(const port* p, const uint32_t bytes, const uint32_t busy_ms) {
+  return (uint64_t)bytes * 10 * 1000 / p->baud + busy_ms + SLACK_MS;
+}
+
+static const char* port_strerror(const int e) {
+  switch (e) {
+    case E_IO:
+      return strerror(errno);
+    case E_TIMEOUT:
+      return "timeout";
+    case E_NAK:
+      return "command refused";
+    case E_PROTO:
+      return "unexpected answer";
+    case E_VERIFY:
+      return "verification failed";
+  }
+  return "unknown error";
+}
+
+static int port_set_baud(port* p, const uint8_t code) {
+  p->baud = baudrates[code].rate;
+  return config_serial(p->fd, baudrates[code].speed, 0);
+}
+
+int port_open(port* p, char const* path) {
+  memset(p, 0, sizeof(*p));
+
+  p->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (p->fd < 0)
+    return E_IO;
+
+  return port_set_baud(p, DEFAULT_BAUD);
+}
+
+// Wait up to timeout_ms for data, then move whatever arrived into the ring.
+// Returns bytes received, 0 on timeout.
+static int port_fill(port* p, const int timeout_ms) {
+  struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+  int ret, got = 0;
+
+  ret = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : 0);
+  if (ret < 0)
+    return errno == EINTR ? 0 : E_IO;
+  if (ret == 0)
+    return 0;
+
+  while (p->tail - p->head < RX_RING) {
+    const uint32_t at = p->tail % RX_RING;
+    const uint32_t room = MIN(RX_RING - at, RX_RING - (p->tail - p->head));
+
+    ret = read(p->fd, p->rx + at, room);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (ret < 0)
+      return E_IO;
+    if (ret == 0)
+      break;
+
+    p->tail += ret;
+    got += ret;
+    if ((uint32_t)ret < room)
+      break;
+  }
+
+  // Readable but nothing to read: adapter unplugged
+  if (got == 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+    errno = EIO;
+    return E_IO;
+  }
+
+  return got;
+}
+
+// Move len bytes out of the ring, buf may be NULL to drop them
+static void port_take(port* p, uint8_t* buf, const uint32_t len) {
+  for (uint32_t done = 0; done < len; ) {
+    const uint32_t at = p->head % RX_RING;
+    const uint32_t n = MIN(len - done, RX_RING - at);
+
+    if (buf)
+      memcpy(buf + done, p->rx + at, n);
+    p->head += n;
+    done += n;
+  }
+}
+
+// Put back the last len bytes taken: nothing is received in between, so
+// they are still in the ring
+static void port_untake(port* p, const uint32_t len) {
+  p->head -= len;
+}
+
+// Bytes ready to be read, without waiting
+static int port_avail(port* p) {
+  const int ret = port_fill(p, 0);
+
+  if (ret < 0)
+    return ret;
+
+  return p->tail - p->head;
+}
+
+// Read exactly len bytes within budget_ms
+static int port_read(port* p, uint8_t* buf, const uint32_t len, const int budget_ms) {
+  const int64_t deadline = now_ms() + budget_ms;
+  uint32_t done = 0;
+
+  while (1) {
+    const uint32_t n = MIN(len - done, p->tail - p->head);
+
+    port_take(p, buf ? buf + done : NULL, n);
+    done += n;
+    if (done == len)
+      return 0;
+
+    const int64_t left = deadline - now_ms();
+    if (left <= 0)
+      return E_TIMEOUT;
+
+    const int ret = port_fill(p, left);
+    if (ret < 0)
+      return ret;
+  }
+}
+
+// Read at least one and up to len bytes within budget_ms.
+// Returns bytes read.
+static int port_read_some(port* p, uint8_t* buf, const uint32_t len, const int budget_ms) {
+  const int64_t deadline = now_ms() + budget_ms;
+
+  while (p->tail == p->head) {
+    const int64_t left = deadline - now_ms();
+    if (left <= 0)
+      return E_TIMEOUT;
+
+    const int ret = port_fill(p, left);
+    if (ret < 0)
+      return ret;
+  }
+
+  const uint32_t n = MIN(len, p->tail - p->head);
+  port_take(p, buf, n);
+
+  return n;
+}
+
+static int port_write(port* p, const uint8_t* buf, const uint32_t len) {
+  const int64_t deadline = now_ms() + port_budget(p, len + TTY_TXBUF, 0);
+  uint32_t done = 0;
+
+  while (done < len) {
+    const int ret = write(p->fd, buf + done, len - done);
+
+    if (ret > 0) {
+      done += ret;
+      continue;
+    }
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return E_IO;
 
-void hexdump(const void* buf, const unsigned len) {
-  printf("%6.6X", 0);
+    // Kernel buffer is full, wait for room
+    const int64_t left = deadline - now_ms();
+    if (left <= 0)
+      return E_TIMEOUT;
+
+    struct pollfd pfd = { .fd = p->fd, .events = POLLOUT };
+    if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+      return E_IO;
+  }
+
+  return 0;
+}
+
+// Forget anything received or still to be sent. Only to resync the link,
+// never in the normal flow: it would eat pipelined answers.
+static void port_drain(port* p) {
+  tcflush(p->fd, TCIOFLUSH);
+  p->head = p->tail;
+}
+
+void hexdump(const void* buf, const unsigned len, const unsigned base) {
+  printf("%6.6X", base);
 
   for (unsigned i = 0, chunk = 0; i < len; i++, chunk++) {
     printf(" %2.2X", *((const char*)buf + i) & 0xFF);
 
-    if (chunk == 15) {
-      printf("\n%6.6X", i+1);
-      chunk = -1;
+    if (chunk == 15) {
+      printf("\n%6.6X", base+i+1);
+      chunk = -1;
+    }
+  }
+  printf("\n");
+}
+
+void printHex(char* p, int n) {
+  for (int i = 0; i < n; ++i) {
+    printf("%2X ", p[i] & 0xff);
+  }
+  printf("\n");
+}
+
+typedef enum _log_level {
+  FATAL,
+  ERROR,
+  WARNING,
+  INFO,
+  DEBUG
+} log_level;
+
+log_level g_log_level = INFO;
+
+// Compress data on the link, where the programmer supports it
+bool g_compress = false;
+
+// Device each line is about, when driving more than one programmer
+static _Thread_local const char* g_tag;
+
+void print(log_level l, const char* fmt, ...) {
+  if (g_log_level < l)
+    return;
+  
+  va_list ap;
+  va_start(ap, fmt);
+  // Lines from different programmers must not mix
+  flockfile(stdout);
+  switch(l){
+    case DEBUG:
+      printf("[DEBUG  ] ");
+      break;
+    case INFO:
+      printf("[INFO   ] ");
+      break;
+    case WARNING:
+      printf("[WARNING] ");
+      break;
+    case ERROR:
+      printf("[ERROR  ] ");
+      break;
+    case FATAL:
+      printf("[FATAL  ] ");
+      break;
+  }
+  if (g_tag)
+    printf("%s: ", g_tag);
+  vprintf(fmt, ap);
+  funlockfile(stdout);
+  va_end(ap);
+}
+
+
+// Device time for commands that scan a range (blank check, CRC)
+#define SCAN_US_PER_BYTE 20
+// Device time per sample of a multi-pass read, with the address presented
+// again and the later samples of --vary-tacc
+#define VOTE_US_PER_SAMPLE 20
+// Longest a write cycle keeps the programmer busy: past tWC it gives up
+// data polling after 20 ms (TWC_TIMEOUT, chip protected or worn out)
+#define WRITE_CYCLE_MS 20
+
+// Answer to a command: ACK, then len bytes of data straight where they
+// belong. A NAK comes alone.
+static int read_answer(port* p, uint8_t* data, const uint32_t len, const int budget_ms) {
+  int ret;
+  uint8_t ack;
+
+  ret = port_read(p, &ack, 1, budget_ms);
+  if (ret < 0)
+    return ret;
+
+  if (ack == S_NAK) {
+    print(DEBUG, "NAK\n");
+    return E_NAK;
+  } else if (ack != S_ACK) {
+    print(DEBUG, "WTF: %x\n", ack);
+    return E_PROTO;
+  }
+
+  print(DEBUG, "ACK\n");
+
+  ret = port_read(p, data, len, budget_ms);
+  if (ret < 0)
+    return ret;
+
+  print(DEBUG, "Read %d bytes\n", len + 1);
+
+  return 0;
+}
+
+// Send a command, then wait for the answer carrying len bytes of data.
+// busy_ms is how long the programmer may take to execute it.
+static int command(port* p, const uint8_t* cmd, const uint32_t clen,
+                   uint8_t* data, const uint32_t len, const uint32_t busy_ms) {
+  int ret;
+
+  ret = port_write(p, cmd, clen);
+  if (ret < 0)
+    return ret;
+
+  return read_answer(p, data, len, port_budget(p, clen + 1 + len, busy_ms));
+}
+
+int op_pgmname(port* p) {
+  int ret;
+  const uint8_t op = S_CMD_Q_PGMNAME;
+  char pgmname[16];
+
+  ret = command(p, &op, 1, (uint8_t*)pgmname, sizeof(pgmname), 0);
+  if (ret < 0)
+    return ret;
+
+  print(INFO, "Successfully connected programmer %.*s\n", sizeof(pgmname), pgmname);
+  return 0;
+}
+
+int op_syncnop(port* p) {
+  int ret;
+  const uint8_t op = S_CMD_SYNCNOP;
+  uint8_t answer[2];
+
+  ret = port_write(p, &op, 1);
+  if (ret < 0)
+    return ret;
+
+  ret = port_read(p, answer, sizeof(answer), port_budget(p, 3, 0));
+  if (ret < 0)
+    return ret;
+
+  // Expect NAK, then ACK
+  return answer[0] == S_NAK && answer[1] == S_ACK ? 0 : E_PROTO;
+}
+
+// Switch both ends to baudrates[code]. If the programmer does not echo the
+// confirmation at the new speed, both ends go back to baudrates[cur] and
+// E_NAK is returned.
+int op_baud(port* p, const uint8_t code, const uint8_t cur) {
+  int ret;
+  const uint8_t cmd[] = { S_CMD_S_BAUD, code };
+  const uint8_t confirm = S_BAUD_CONFIRM;
+  uint8_t echo = 0;
+
+  ret = command(p, cmd, sizeof(cmd), NULL, 0, 0);
+  if (ret < 0)
+    return ret;
+
+  // Programmer switches and flushes its input as soon as the last bit of
+  // its ACK is out, before we can have read it
+  ret = port_set_baud(p, code);
+  if (ret < 0)
+    return ret;
+
+  ret = port_write(p, &confirm, 1);
+  if (ret < 0)
+    return ret;
+
+  if (port_read(p, &echo, 1, 500) == 0 && echo == S_BAUD_CONFIRM) {
+    print(DEBUG, "Link is now at %d baud\n", baudrates[code].rate);
+    return 0;
+  }
+
+  // Programmer gives up waiting after ~200ms, then we resync at old speed
+  usleep(300000);
+  ret = port_set_baud(p, cur);
+  if (ret < 0)
+    return ret;
+  port_drain(p);
+  if (op_syncnop(p) == 0)
+    return E_NAK;
+
+  // Programmer got the confirmation but we lost its echo
+  ret = port_set_baud(p, code);
+  if (ret < 0)
+    return ret;
+  port_drain(p);
+  return op_syncnop(p);
+}
+
+// Bitmap of the commands the programmer supports
+int op_cmdmap(port* p, uint8_t map[32]) {
+  const uint8_t op = S_CMD_Q_CMDMAP;
+
+  return command(p, &op, 1, map, 32, 0);
+}
+
+// Whether the programmer answers op, from the map fetched at handshake
+static bool has_cmd(const port* p, const uint8_t op) {
+  return (p->cmdmap[op / 8] >> (op % 8)) & 1;
+}
+
+int op_opbuf_init(port* p) {
+  const uint8_t op = S_CMD_O_INIT;
+
+  return command(p, &op, 1, NULL, 0, 0);
+}
+
+int op_opbuf_len(port* p, uint32_t* len) {
+  int ret;
+  const uint8_t op = S_CMD_Q_OPBUF;
+  uint16_t opbuf_len;
+
+  ret = command(p, &op, 1, (uint8_t*)&opbuf_len, sizeof(opbuf_len), 0);
+  if (ret < 0)
+    return ret;
+
+  print(DEBUG, "Opbuf len is %d\n", opbuf_len);
+  *len = opbuf_len;
+  return 0;
+}
+
+int op_serbuf_len(port* p, uint32_t* len) {
+  int ret;
+  const uint8_t op = S_CMD_Q_SERBUF;
+  uint16_t serbuf_len;
+
+  ret = command(p, &op, 1, (uint8_t*)&serbuf_len, sizeof(serbuf_len), 0);
+  if (ret < 0)
+    return ret;
+
+  print(DEBUG, "Serbuf len is %d\n", serbuf_len);
+  *len = serbuf_len;
+  return 0;
+}
+
+// SDP sequence, then the programmer blinks its leds for up to 1 s
+#define SDP_MS 1500
+
+int op_opbuf_sdp(port* p, bool enable) {
+  const uint8_t op = enable ? S_CMD_O_SET_SDP : S_CMD_O_RESET_SDP;
+
+  return command(p, &op, 1, NULL, 0, SDP_MS);
+}
+
+int op_pagesize(port* p, const uint16_t page) {
+  const uint8_t cmd[] = {
+    S_CMD_S_PAGESIZE, // Opcode
+    page & 0xFF, (page >> 8) & 0xFF, // 16-bit page size, LE
+  };
+
+  return command(p, cmd, sizeof(cmd), NULL, 0, 0);
+}
+
+// busy_ms is the time the queued operations may take
+int op_opbuf_exec(port* p, const uint32_t busy_ms) {
+  const uint8_t op = S_CMD_O_EXEC;
+
+  return command(p, &op, 1, NULL, 0, busy_ms);
+}
+
+// Same encoding as the firmware, out must hold 3 * len bytes.
+// Returns encoded length.
+static uint32_t rle_encode(const uint8_t* in, const uint32_t len, uint8_t* out) {
+  uint32_t o = 0;
+
+  for (uint32_t i = 0; i < len; ) {
+    uint32_t run = 1;
+
+    while (i + run < len && in[i + run] == in[i] && run < 255)
+      run++;
+
+    if (run >= 4 || in[i] == S_RLE_ESC) {
+      out[o++] = S_RLE_ESC;
+      out[o++] = run;
+      out[o++] = in[i];
+    } else {
+      memset(out + o, in[i], run);
+      o += run;
+    }
+    i += run;
+  }
+
+  return o;
+}
+
+// Receives data read from the chip, in address order. off is relative to
+// the start of the read.
+typedef void (*sink_fn)(void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len);
+
+// Reads are handed to sinks in chunks of this size, whatever the length
+#define READ_CHUNK 4096
+
+static void sink_put(sink_fn sink, void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len) {
+  if (g_log_level >= DEBUG)
+    hexdump(buf, len, off);
+
+  sink(ctx, off, buf, len);
+}
+
+static int read_raw(port* p, const uint32_t len, sink_fn sink, void* ctx) {
+  uint8_t buf[READ_CHUNK];
+
+  for (uint32_t off = 0; off < len; ) {
+    const uint32_t n = MIN(sizeof(buf), len - off);
+    const int ret = port_read_some(p, buf, n, port_budget(p, n, 0));
+    if (ret < 0)
+      return ret;
+
+    sink_put(sink, ctx, off, buf, ret);
+    off += ret;
+  }
+
+  return 0;
+}
+
+// Decode the RLE stream as it arrives, until len bytes are produced
+static int read_rle(port* p, const uint32_t len, sink_fn sink, void* ctx) {
+  uint8_t in[READ_CHUNK], buf[READ_CHUNK];
+  uint32_t out = 0, fill = 0, wire = 0;
+  uint8_t count = 0;
+  int state = 0;    // 0 data, 1 count after escape, 2 byte to repeat
+
+  while (out + fill < len) {
+    const int ret = port_read_some(p, in, sizeof(in), port_budget(p, sizeof(in), 0));
+    if (ret < 0)
+      return ret;
+
+    wire += ret;
+    for (int i = 0; i < ret; i++) {
+      if (state == 0 && in[i] != S_RLE_ESC) {
+        count = 1;
+      } else if (state == 0) {
+        state = 1;
+        continue;
+      } else if (state == 1) {
+        count = in[i];
+        state = 2;
+        continue;
+      } else {
+        state = 0;
+      }
+
+      if (out + fill + count > len) {
+        print(ERROR, "Corrupted RLE stream at %d\n", out + fill);
+        return E_PROTO;
+      }
+
+      while (count) {
+        const uint32_t n = MIN(count, sizeof(buf) - fill);
+
+        memset(buf + fill, in[i], n);
+        fill += n;
+        count -= n;
+        if (fill == sizeof(buf)) {
+          sink_put(sink, ctx, out, buf, fill);
+          out += fill;
+          fill = 0;
+        }
+      }
+
+      // Whatever follows the stream belongs to the next answer
+      if (out + fill == len) {
+        port_untake(p, ret - i - 1);
+        wire -= ret - i - 1;
+        break;
+      }
+    }
+  }
+
+  if (fill)
+    sink_put(sink, ctx, out, buf, fill);
+
+  print(DEBUG, "Read %d bytes in %d link bytes (%.1f:1)\n", len, wire,
+        wire ? (double)len / wire : 0.0);
+
+  return 0;
+}
+
+// Stream len bytes from ba to sink
+int op_read(port* p, const uint32_t ba, const uint32_t len, sink_fn sink, void* ctx) {
+  int ret;
+  const uint8_t header[] = {
+    p->rle_read ? S_CMD_R_NBYTES_RLE : S_CMD_R_NBYTES, // Opcode
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
+  };
+
+  // Data follows the ACK, it is streamed to sink as it arrives
+  ret = command(p, header, sizeof(header), NULL, 0, 0);
+  if (ret == E_NAK)
+    print(ERROR, "Read refused by programmer\n");
+  if (ret < 0)
+    return ret;
+
+  if (p->rle_read)
+    return read_rle(p, len, sink, ctx);
+  else
+    return read_raw(p, len, sink, ctx);
+}
+
+static uint32_t get_le(const uint8_t* b, const int n) {
+  uint32_t v = 0;
+
+  for (int i = n - 1; i >= 0; i--)
+    v = v << 8 | b[i];
+  return v;
+}
+
+// Bytes that read differently from one sample to the next
+#define UNSTABLE_MAX 256
+typedef struct _unstable {
+  uint32_t count;       // Bytes whose samples disagreed
+  uint32_t listed;      // Of those, addresses in addr
+  uint32_t addr[UNSTABLE_MAX];
+} unstable;
+
+// Same as op_read, with each byte sampled passes times by the programmer,
+// which streams the majority. Reads go READ_CHUNK at a time, each listing
+// up to S_VOTE_LIST of its unstable bytes, collected in u.
+int op_read_vote(port* p, const uint32_t ba, const uint32_t len, const uint8_t mode,
+                 sink_fn sink, void* ctx, unstable* u) {
+  uint8_t buf[READ_CHUNK];
+  int ret;
+
+  for (uint32_t off = 0; off < len; ) {
+    const uint32_t a = ba + off, n = MIN(sizeof(buf), len - off);
+    const uint8_t header[] = {
+      S_CMD_R_NBYTES_VOTE, // Opcode
+      a & 0xFF, (a >> 8) & 0xFF, (a >> 16) & 0xFF, // 24-bit addr, LE
+      n & 0xFF, (n >> 8) & 0xFF, (n >> 16) & 0xFF, // 24-bit length, LE
+      mode,
+    };
+    uint8_t list[2 + S_VOTE_LIST * 2];
+    uint16_t count;
+
+    ret = command(p, header, sizeof(header), NULL, 0, 0);
+    if (ret == E_NAK)
+      print(ERROR, "Multi-pass read refused by programmer\n");
+    if (ret < 0)
+      return ret;
+
+    // Voted bytes, then the unstable count and offsets
+    ret = port_read(p, buf, n, port_budget(p, n,
+                    (uint64_t)n * (mode & S_VOTE_PASSES) * VOTE_US_PER_SAMPLE / 1000));
+    if (ret < 0)
+      return ret;
+    sink_put(sink, ctx, off, buf, n);
+
+    ret = port_read(p, list, 2, port_budget(p, 2, 0));
+    if (ret < 0)
+      return ret;
+    count = get_le(list, 2);
+    ret = port_read(p, list + 2, MIN(count, S_VOTE_LIST) * 2, port_budget(p, sizeof(list), 0));
+    if (ret < 0)
+      return ret;
+
+    for (uint16_t i = 0; i < MIN(count, S_VOTE_LIST) && u->listed < UNSTABLE_MAX; i++)
+      u->addr[u->listed++] = a + get_le(list + 2 + i * 2, 2);
+    u->count += count;
+    off += n;
+  }
+
+  return 0;
+}
+
+// Print the bytes a multi-pass read found unstable, eight to a line
+static void report_unstable(const unstable* u, const int passes) {
+  if (!u->count) {
+    print(INFO, "All bytes read the same in %d passes\n", passes);
+    return;
+  }
+
+  print(WARNING, "%u bytes read differently across %d passes, the file has the majority\n",
+        u->count, passes);
+  for (uint32_t i = 0; i < u->listed; i += 8) {
+    char line[8 * 7 + 1] = "";
+
+    for (uint32_t k = i; k < MIN(i + 8, u->listed); k++)
+      snprintf(line + strlen(line), sizeof(line) - strlen(line), " %05x", u->addr[k]);
+    print(WARNING, "Unstable:%s\n", line);
+  }
+  if (u->count > u->listed)
+    print(WARNING, "%u more not listed\n", u->count - u->listed);
+}
+
+static void sink_file(void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len) {
+  FILE* fp = ctx;
+  (void)off;
+
+  // Flush every chunk: an aborted dump still leaves what was read
+  fwrite(buf, sizeof(char), len, fp);
+  fflush(fp);
+  if (ferror(fp) != 0) {
+    print(ERROR, "Error writing file");
+    exit(-1);
+  }
+}
+
+static void sink_copy(void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len) {
+  memcpy((uint8_t*)ctx + off, buf, len);
+}
+
+typedef struct _compare {
+  const uint8_t* ref;   // Expected content, NULL for blank (0xFF)
+  uint32_t bad;         // Bytes that differ
+  uint32_t first;       // Offset of first one
+} compare;
+
+static void sink_compare(void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len) {
+  compare* c = ctx;
+
+  for (uint32_t i = 0; i < len; i++) {
+    if (buf[i] == (c->ref ? c->ref[off + i] : 0xFF))
+      continue;
+    if (!c->bad)
+      c->first = off + i;
+    c->bad++;
+  }
+}
+
+// Number of bytes not in erased state (0xFF) in a range. Programmers that
+// can't count them send the range.
+int op_blank(port* p, const uint32_t ba, const uint32_t len, uint32_t* dirty) {
+  if (!has_cmd(p, S_CMD_Q_BLANK)) {
+    compare cmp = { NULL, 0, 0 };
+    const int ret = op_read(p, ba, len, sink_compare, &cmp);
+
+    *dirty = cmp.bad;
+    return ret;
+  }
+
+  const uint8_t header[] = {
+    S_CMD_Q_BLANK, // Opcode
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
+  };
+
+  return command(p, header, sizeof(header), (uint8_t*)dirty, sizeof(*dirty),
+                 (uint64_t)len * SCAN_US_PER_BYTE / 1000);
+}
+
+int op_crc32(port* p, const uint32_t ba, const uint32_t len, uint32_t* crc) {
+  const uint8_t header[] = {
+    S_CMD_Q_CRC32, // Opcode
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
+  };
+
+  return command(p, header, sizeof(header), (uint8_t*)crc, sizeof(*crc),
+                 (uint64_t)len * SCAN_US_PER_BYTE / 1000);
+}
+
+int op_errorcnt_reset(port* p) {
+  const uint8_t op = S_CMD_S_ERRORCNT_RESET;
+
+  return command(p, &op, 1, NULL, 0, 0);
+}
+
+int op_errorcnt(port* p, uint32_t* errors_cnt) {
+  const uint8_t op = S_CMD_Q_ERRORCNT;
+
+  return command(p, &op, 1, (uint8_t*)errors_cnt, sizeof(*errors_cnt), 0);
+}
+
+// Counters kept by the programmer since they were last cleared
+typedef struct _perf {
+  uint16_t rx_high;         // Most bytes seen waiting in its RX ring
+  uint16_t rx_overruns;     // Bytes it lost
+  uint16_t tx_stalls;       // Times it waited for room to send
+  uint32_t poll_total;      // Data polling iterations
+  uint32_t poll_max;        // Longest data polling
+  uint32_t bytes_read;
+  uint32_t bytes_written;
+  uint32_t read_ticks;      // Time in read cycles, in PERF_TICK_US
+  uint32_t write_ticks;     // Time loading pages and polling
+  uint16_t stack_unused;    // RAM its stack never reached, 0xFFFF if unknown
+} perf;
+
+#define PERF_TICK_US 0.5
+// Stack headroom below which the firmware RAM budget is too tight
+#define STACK_MARGIN 32
+
+int op_perf(port* p, perf* c, const bool clear) {
+  int ret;
+  const uint8_t cmd[] = { S_CMD_Q_PERF, clear };
+  uint8_t a[3 * 2 + 6 * 4 + 2];
+
+  ret = command(p, cmd, sizeof(cmd), a, sizeof(a), 0);
+  if (ret < 0)
+    return ret;
+
+  c->rx_high = get_le(a, 2);
+  c->rx_overruns = get_le(a + 2, 2);
+  c->tx_stalls = get_le(a + 4, 2);
+  c->poll_total = get_le(a + 6, 4);
+  c->poll_max = get_le(a + 10, 4);
+  c->bytes_read = get_le(a + 14, 4);
+  c->bytes_written = get_le(a + 18, 4);
+  c->read_ticks = get_le(a + 22, 4);
+  c->write_ticks = get_le(a + 26, 4);
+  c->stack_unused = get_le(a + 30, 2);
+  return 0;
+}
+
+// Power the socket and drive the bus, or power it down so that the chip can
+// be swapped
+int op_pin_state(port* p, const bool on) {
+  const uint8_t cmd[] = { S_CMD_S_PIN_STATE, on };
+
+  return command(p, cmd, sizeof(cmd), NULL, 0, 0);
+}
+
+// Chip profile from the programmer table
+#define CHIP_NAME_LEN 12
+#define CHIP_ID           0x01  // Answers the software ID sequence
+#define CHIP_SDP          0x02  // Software data protection
+#define CHIP_SECTOR_WRITE 0x04  // A write cycle rewrites the whole page
+#define CHIP_NOR          0x08  // Commands to program a byte, to erase
+#define CHIP_ERASE        0x10  // EEPROM with the software chip erase
+
+typedef struct _chip {
+  char name[CHIP_NAME_LEN + 1];
+  uint8_t mfr, dev;     // Software ID, with CHIP_ID
+  uint32_t size;
+  uint32_t sector;      // Erase sector, 0 when erased by writing
+  uint16_t page;        // Bytes per write cycle, 0 when not writable
+  uint16_t tacc_ns;
+  uint16_t twp_ns;
+  uint16_t twc_us;
+  uint16_t tse_ms;      // Sector erase
+  uint16_t tce_ms;      // Chip erase, NOR or CHIP_ERASE
+  uint8_t flags;
+} chip;
+
+// Software ID entry and exit wait 11ms each, then up to 5 bytes are put back
+#define CHIPID_MS 150
+
+// Ask the chip its software ID; the programmer uses the matching profile.
+// index is S_CHIP_NONE if unknown, mfr and dev 0 if the chip did not answer.
+int op_chipid(port* p, uint8_t* mfr, uint8_t* dev, uint8_t* index) {
+  int ret;
+  const uint8_t op = S_CMD_Q_CHIPID;
+  uint8_t a[3];
+
+  ret = command(p, &op, 1, a, sizeof(a), CHIPID_MS);
+  if (ret < 0)
+    return ret;
+
+  *mfr = a[0];
+  *dev = a[1];
+  *index = a[2];
+  return 0;
+}
+
+// Profile index of the programmer table, E_NAK past its end
+int op_chip(port* p, const uint8_t index, chip* c) {
+  int ret;
+  const uint8_t cmd[] = { S_CMD_Q_CHIP, index };
+  uint8_t a[CHIP_NAME_LEN + 4 + 6 * 2 + 1];
+
+  ret = command(p, cmd, sizeof(cmd), a, sizeof(a), 0);
+  if (ret < 0)
+    return ret;
+
+  memcpy(c->name, a, CHIP_NAME_LEN);
+  c->name[CHIP_NAME_LEN] = '\0';
+  c->mfr = a[12];
+  c->dev = a[13];
+  c->size = 1 << a[14];
+  c->sector = a[15] ? 1 << a[15] : 0;
+  c->page = get_le(a + 16, 2);
+  c->tacc_ns = get_le(a + 18, 2);
+  c->twp_ns = get_le(a + 20, 2);
+  c->twc_us = get_le(a + 22, 2);
+  c->tse_ms = get_le(a + 24, 2);
+  c->tce_ms = get_le(a + 26, 2);
+  c->flags = a[28];
+  return 0;
+}
+
+// Use the timings of a profile, S_CHIP_NONE for the worst case
+int op_set_chip(port* p, const uint8_t index) {
+  const uint8_t cmd[] = { S_CMD_S_CHIP, index };
+
+  return command(p, cmd, sizeof(cmd), NULL, 0, 0);
+}
+
+// Erase a sector or the whole chip, for chips that have erase commands.
+// busy_ms is how long it may take, done tells whether it completed.
+int op_erase(port* p, const uint8_t what, const uint32_t ba, const uint32_t busy_ms, bool* done) {
+  int ret;
+  const uint8_t cmd[] = {
+    S_CMD_S_ERASE, what,
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+  };
+  uint8_t status;
+
+  ret = command(p, cmd, sizeof(cmd), &status, 1, busy_ms);
+  if (ret < 0)
+    return ret;
+
+  *done = status == 0;
+  return 0;
+}
+
+// Commands sent ahead of their ACK. Bytes of unacknowledged commands may
+// still sit in the programmer serial buffer, so they must fit serbuf_len.
+#define PIPE_DEPTH 64
+
+typedef struct _pipeline {
+  port* port;
+  uint32_t window;    // Serial buffer size, in bytes
+  uint32_t inflight;  // Bytes sent and not yet acknowledged
+  unsigned head;      // Oldest command waiting for its ACK
+  unsigned count;
+  struct {
+    uint8_t op;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t busy;    // Time the programmer may spend on it, in ms
+  } cmd[PIPE_DEPTH];
+  uint32_t naks;
+} pipeline;
+
+static void pipe_init(pipeline* p, port* port, const uint32_t window) {
+  memset(p, 0, sizeof(*p));
+  p->port = port;
+  p->window = window;
+}
+
+// Consume one ACK, the answer to the oldest command in flight. It comes at
+// the latest once the bytes in flight went through and the command ran.
+static int pipe_ack(pipeline* p) {
+  int ret;
+  uint8_t ack;
+
+  ret = port_read(p->port, &ack, 1,
+                  port_budget(p->port, p->inflight + 1, p->cmd[p->head].busy));
+  if (ret < 0) {
+    print(ERROR, "Command %02x at addr %x: no answer\n", p->cmd[p->head].op,
+          p->cmd[p->head].addr);
+    return ret;
+  }
+
+  if (ack != S_ACK) {
+    print(ERROR, "Command %02x at addr %x: %s\n", p->cmd[p->head].op,
+          p->cmd[p->head].addr, ack == S_NAK ? "NAK" : "unexpected answer");
+    p->naks++;
+  }
+
+  p->inflight -= p->cmd[p->head].len;
+  p->head = (p->head + 1) % PIPE_DEPTH;
+  p->count--;
+
+  return 0;
+}
+
+// Consume the ACKs that already arrived, without blocking
+static int pipe_poll(pipeline* p) {
+  int ret;
+
+  while (p->count && (ret = port_avail(p->port)) != 0) {
+    if (ret < 0)
+      return ret;
+
+    ret = pipe_ack(p);
+    if (ret < 0)
+      return ret;
+  }
+
+  return 0;
+}
+
+static int pipe_send(pipeline* p, const uint8_t op, const uint32_t addr,
+                     const uint8_t* hdr, const uint32_t hlen,
+                     const uint8_t* buf, const uint32_t len, const uint32_t busy) {
+  int ret;
+  const uint32_t tlen = hlen + len;
+
+  ret = pipe_poll(p);
+  if (ret < 0)
+    return ret;
+
+  // Wait for credits. A command larger than the window goes alone.
+  while (p->count == PIPE_DEPTH || (p->count && p->inflight + tlen > p->window)) {
+    ret = pipe_ack(p);
+    if (ret < 0)
+      return ret;
+  }
+
+  ret = port_write(p->port, hdr, hlen);
+  if (ret < 0)
+    return ret;
+
+  if (len) {
+    ret = port_write(p->port, buf, len);
+    if (ret < 0)
+      return ret;
+  }
+
+  const unsigned tail = (p->head + p->count) % PIPE_DEPTH;
+  p->cmd[tail].op = op;
+  p->cmd[tail].addr = addr;
+  p->cmd[tail].len = tlen;
+  p->cmd[tail].busy = busy;
+  p->count++;
+  p->inflight += tlen;
+
+  return 0;
+}
+
+static int pipe_writen(pipeline* p, const uint32_t ba, const uint8_t* buf, const uint32_t len) {
+  const uint8_t header[] = {
+    S_CMD_O_WRITEN, // Opcode
+    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+  };
+
+  return pipe_send(p, S_CMD_O_WRITEN, ba, header, sizeof(header), buf, len, 0);
+}
+
+// Same as pipe_writen, buf holds elen bytes of RLE stream expanding to len
+static int pipe_writen_rle(pipeline* p, const uint32_t ba, const uint8_t* buf, const uint32_t len, const uint32_t elen) {
+  const uint8_t header[] = {
+    S_CMD_O_WRITEN_RLE, // Opcode
+    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
+    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
+  };
+
+  return pipe_send(p, S_CMD_O_WRITEN_RLE, ba, header, sizeof(header), buf, elen, 0);
+}
+
+// cycles is the number of write cycles queued in opbuf
+static int pipe_exec(pipeline* p, const uint32_t ba, const uint32_t cycles) {
+  const uint8_t op = S_CMD_O_EXEC;
+
+  return pipe_send(p, S_CMD_O_EXEC, ba, &op, 1, NULL, 0, cycles * WRITE_CYCLE_MS);
+}
+
+// Wait for every command in flight
+static int pipe_flush(pipeline* p) {
+  while (p->count) {
+    const int ret = pipe_ack(p);
+    if (ret < 0)
+      return ret;
+  }
+
+  return 0;
+}
+
+// Each Write-N record takes 7 bytes of opbuf besides its payload
+#define OPBUF_RECORD 7
+// Largest page the firmware takes, so the largest chunk
+#define PAGE_MAX 512
+// Write cycles per exec, so that an exec never keeps the programmer silent
+// for long: 5 s at a 10 ms tWC, 10 s if every cycle runs into the timeout
+#define EXEC_MAX_CYCLES 500
+
+// Programs one or more address ranges, batching Write-N records into opbuf
+typedef struct _writer {
+  port* port;
+  pipeline p;
+  uint32_t opbuf_len;
+  uint32_t page;
+  uint32_t chunk;
+  uint32_t avspace;
+  uint32_t cycles;
+  uint32_t chunks, execs;
+  bool skip_blank;      // Target known erased: 0xFF chunks need no write
+  uint32_t skipped;
+  bool rle;             // Send chunks RLE encoded when shorter
+  uint32_t payload;     // Chunk bytes
+  uint32_t wire;        // Chunk bytes actually sent
+} writer;
+
+static void writer_init(writer* w, port* port, const uint32_t opbuf_len, const uint32_t serbuf_len, const uint32_t page) {
+  memset(w, 0, sizeof(*w));
+  w->port = port;
+  w->opbuf_len = opbuf_len;
+  w->page = page;
+  w->avspace = opbuf_len;
+
+  // In page mode a chunk must never straddle a page boundary
+  w->chunk = page > 64 ? page : 64;
+  if (opbuf_len > OPBUF_RECORD)
+    w->chunk = MIN(w->chunk, opbuf_len - OPBUF_RECORD);
+
+  // Keep the programmer busy: next chunks travel while the current one is
+  // being programmed. Its RX ring keeps a slot free.
+  pipe_init(&w->p, port, serbuf_len - 1);
+}
+
+static int writer_commit(writer* w, const uint32_t ba) {
+  const int ret = pipe_exec(&w->p, ba, w->cycles);
+  if (ret < 0)
+    return ret;
+
+  print(DEBUG, "Committed opbuf\n");
+  w->avspace = w->opbuf_len;
+  w->cycles = 0;
+  w->execs++;
+
+  return 0;
+}
+
+static bool is_blank(const uint8_t* buf, const uint32_t len) {
+  for (uint32_t i = 0; i < len; i++)
+    if (buf[i] != 0xFF)
+      return false;
+  return true;
+}
+
+static int writer_put(writer* w, const uint8_t *wbuf, const uint32_t len, const uint32_t ba) {
+  int ret;
+  uint32_t off = 0;
+
+  // Split this request in multiple ones to fit opbuf and to avoid
+  // uart congestion
+  while(off < len) {
+    uint32_t plen = MIN(w->chunk, (len-off));
+    if (w->page > 1)
+      plen = MIN(plen, w->page - (ba + off) % w->page);
+
+    if (w->skip_blank && is_blank(wbuf + off, plen)) {
+      off += plen;
+      w->skipped++;
+      continue;
+    }
+
+    // No more space available in opbuf, time to commit
+    if (w->avspace != w->opbuf_len &&
+        (w->avspace < (OPBUF_RECORD + plen) || w->cycles >= EXEC_MAX_CYCLES)) {
+      ret = writer_commit(w, ba + off);
+      if (ret < 0)
+        return ret;
+    }
+
+    print(DEBUG, "Im' writing size %d at addr %x\n", plen, ba+off);
+    uint8_t ebuf[3 * PAGE_MAX];
+    const uint32_t elen = w->rle ? rle_encode(wbuf + off, plen, ebuf) : plen;
+
+    if (elen < plen) {
+      ret = pipe_writen_rle(&w->p, ba + off, ebuf, plen, elen);
+    } else {
+      ret = pipe_writen(&w->p, ba + off, wbuf + off, plen);
+    }
+    if (ret < 0)
+      return ret;
+    w->chunks++;
+    w->payload += plen;
+    w->wire += MIN(elen, plen);
+
+    off += plen;
+    w->avspace -= (plen + OPBUF_RECORD);
+    w->cycles += w->page > 1 ? 1 : plen;
+  }
+
+  return 0;
+}
+
+// Commit and wait until everything put so far is programmed
+static int writer_flush(writer* w) {
+  if (w->avspace != w->opbuf_len) {
+    const int ret = writer_commit(w, 0);
+    if (ret < 0)
+      return ret;
+  }
+
+  return pipe_flush(&w->p);
+}
+
+static int writer_finish(writer* w) {
+  int ret;
+  uint32_t errors;
+
+  ret = writer_flush(w);
+  if (ret < 0)
+    return ret;
+
+  if (w->p.naks)
+    print(ERROR, "%d commands refused by programmer\n", w->p.naks);
+
+  print(INFO, "%d chunks in %d opbuf executions, %d round trips saved\n",
+        w->chunks, w->execs, w->chunks - w->execs);
+  if (w->skip_blank)
+    print(INFO, "%d blank chunks skipped\n", w->skipped);
+  if (w->rle)
+    print(INFO, "Sent %d bytes in %d link bytes (%.1f:1)\n", w->payload, w->wire,
+          w->wire ? (double)w->payload / w->wire : 0.0);
+
+  ret = op_errorcnt(w->port, &errors);
+  if (ret < 0)
+    return ret;
+
+  print(INFO, "Write errors: %d\n", errors);
+  return 0;
+}
+
+static int buffer_write(port* port, const uint8_t *wbuf, const int len, const int ba, const uint32_t opbuf_len, const uint32_t serbuf_len, const uint32_t page, const bool skip_blank) {
+  int ret;
+  writer w;
+
+  writer_init(&w, port, opbuf_len, serbuf_len, page);
+  w.skip_blank = skip_blank;
+  w.rle = port->rle_write;
+
+  ret = writer_put(&w, wbuf, len, ba);
+  if (ret < 0)
+    return ret;
+
+  return writer_finish(&w);
+}
+
+#define DELTA_BLOCK 4096
+
+// Program only the pages whose content differs from the chip, then verify
+// what was touched. The chip is compared one block at a time.
+// Returns E_VERIFY on failed verify.
+static int delta_write(port* port, const uint8_t *wbuf, const uint32_t len, const uint32_t ba, const uint32_t opbuf_len, const uint32_t serbuf_len, const uint32_t page, const bool verify) {
+  const uint32_t gran = page > 1 ? page : 64;
+  uint8_t cur[DELTA_BLOCK];
+  uint8_t dirty[DELTA_BLOCK / 8];   // Rewritten pages, bit of their first offset
+  uint32_t changed = 0, total = 0;
+  uint32_t boff, blen;
+  bool ok = true;
+  int ret;
+  writer w;
+
+  writer_init(&w, port, opbuf_len, serbuf_len, page);
+  w.rle = port->rle_write;
+
+  // Blocks are aligned to DELTA_BLOCK, hence to pages
+  for (boff = 0; boff < len; boff += blen) {
+    const uint8_t* wblk = wbuf + boff;
+    const uint32_t bba = ba + boff;
+    uint32_t off, plen;
+    bool touched = false;
+
+    blen = MIN(DELTA_BLOCK - bba % DELTA_BLOCK, len - boff);
+    ret = op_read(port, bba, blen, sink_copy, cur);
+    if (ret < 0)
+      return ret;
+    memset(dirty, 0, sizeof(dirty));
+
+    for (off = 0; off < blen; off += plen) {
+      plen = MIN(gran - (bba + off) % gran, blen - off);
+      total++;
+
+      if (0 == memcmp(wblk + off, cur + off, plen))
+        continue;
+
+      // Page will be verified
+      dirty[off / 8] |= 1 << (off % 8);
+      changed++;
+      touched = true;
+      ret = writer_put(&w, wblk + off, plen, bba + off);
+      if (ret < 0)
+        return ret;
+    }
+
+    if (!touched)
+      continue;
+
+    ret = writer_flush(&w);
+    if (ret < 0)
+      return ret;
+
+    if (!verify)
+      continue;
+
+    // Read back runs of touched pages
+    for (off = 0; off < blen; ) {
+      uint32_t start = off;
+
+      while (off < blen && (dirty[off / 8] >> (off % 8)) & 1)
+        off += MIN(gran - (bba + off) % gran, blen - off);
+
+      if (off == start) {
+        off += MIN(gran - (bba + off) % gran, blen - off);
+        continue;
+      }
+
+      compare cmp = { wblk + start, 0, 0 };
+      ret = op_read(port, bba + start, off - start, sink_compare, &cmp);
+      if (ret < 0)
+        return ret;
+      if (cmp.bad) {
+        print(ERROR, "Failed verification at %x-%x\n", bba + start, bba + off - 1);
+        ok = false;
+      }
+    }
+  }
+
+  print(INFO, "Delta: %d of %d pages differ (%.1f%%)\n", changed, total,
+        total ? 100.0 * changed / total : 0.0);
+
+  if (!changed)
+    return 0;
+
+  ret = writer_finish(&w);
+  if (ret < 0)
+    return ret;
+
+  if (verify && ok)
+    print(INFO, "Verified successfully\n");
+
+  return ok ? 0 : E_VERIFY;
+}
+
+// Same CRC-32 as the firmware (IEEE 802.3, reflected)
+uint32_t crc32(const uint8_t* buf, const uint32_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+  }
+
+  return ~crc;
+}
+
+#define CRC_BLOCK 4096
+
+// Compare CRC of each block, read back only blocks that don't match
+static int fast_verify(port* port, const uint8_t* wbuf, const uint32_t len, const uint32_t ba) {
+  uint32_t bad = 0;
+  uint32_t crc;
+  int ret;
+
+  for (uint32_t off = 0; off < len; off += CRC_BLOCK) {
+    const uint32_t blen = MIN(CRC_BLOCK, len - off);
+
+    ret = op_crc32(port, ba + off, blen, &crc);
+    if (ret < 0)
+      return ret;
+    if (crc == crc32(wbuf + off, blen))
+      continue;
+
+    print(DEBUG, "CRC mismatch at %x, reading back\n", ba + off);
+    compare cmp = { wbuf + off, 0, 0 };
+    ret = op_read(port, ba + off, blen, sink_compare, &cmp);
+    if (ret < 0)
+      return ret;
+    if (cmp.bad) {
+      print(ERROR, "Failed verification at %x-%x\n", ba + off, ba + off + blen - 1);
+      bad++;
+    }
+  }
+
+  return bad ? E_VERIFY : 0;
+}
+
+static int64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define BENCH_ROUNDS 200
+#define BENCH_MAX_CMDS 4096
+// Byte mode costs a write cycle per byte: keep write tests short
+#define BENCH_WRITE_LEN 512
+
+static int cmp_u32(const void* a, const void* b) {
+  const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// One line per test: payload throughput, then command latency percentiles
+static void bench_report(const char* what, uint32_t* us, const uint32_t n, const uint64_t bytes, const int64_t total_us) {
+  qsort(us, n, sizeof(*us), cmp_u32);
+  print(INFO, "%-16s %9.0f B/s  p50 %6d  p90 %6d  p99 %6d  max %6d us\n", what,
+        total_us ? bytes * 1e6 / total_us : 0.0,
+        us[(n - 1) * 50 / 100], us[(n - 1) * 90 / 100], us[(n - 1) * 99 / 100], us[n - 1]);
+}
+
+static void sink_null(void* ctx, const uint32_t off, const uint8_t* buf, const uint32_t len) {
+  (void)ctx; (void)off; (void)buf; (void)len;
+}
+
+// NOP round trips: one byte each way, nothing else
+static int bench_echo(port* p, uint32_t* us) {
+  const uint8_t op = S_CMD_NOP;
+  const int64_t start = now_us();
+
+  for (uint32_t i = 0; i < BENCH_ROUNDS; i++) {
+    const int64_t t = now_us();
+    const int ret = command(p, &op, 1, NULL, 0, 0);
+    if (ret < 0)
+      return ret;
+    us[i] = now_us() - t;
+  }
+
+  bench_report("echo", us, BENCH_ROUNDS, 2 * BENCH_ROUNDS, now_us() - start);
+  return 0;
+}
+
+// Back to back reads of size bytes each, len bytes in all
+static int bench_read(port* p, uint32_t* us, const uint32_t ba, const uint32_t len, const uint32_t size) {
+  const int64_t start = now_us();
+  uint32_t n = 0;
+  char what[32];
+
+  for (uint32_t off = 0; off < len && n < BENCH_MAX_CMDS; off += size, n++) {
+    const int64_t t = now_us();
+    const int ret = op_read(p, ba + off, MIN(size, len - off), sink_null, NULL);
+    if (ret < 0)
+      return ret;
+    us[n] = now_us() - t;
+  }
+
+  snprintf(what, sizeof(what), "read %d", MIN(size, len));
+  bench_report(what, us, n, MIN(len, n * size), now_us() - start);
+  return 0;
+}
+
+// Write-N then exec, one chunk at a time. Whatever the exec takes beyond
+// the link time is the programmer waiting for the chip.
+static int bench_write(port* p, uint32_t* us, const uint8_t* buf, const uint32_t ba, const uint32_t len, const uint32_t chunk) {
+  const uint8_t op = S_CMD_O_EXEC;
+  const int64_t start = now_us();
+  int64_t wait = 0;
+  uint32_t n = 0;
+  char what[32];
+  int ret;
+
+  for (uint32_t off = 0; off < len && n < BENCH_MAX_CMDS; off += chunk, n++) {
+    const uint32_t clen = MIN(chunk, len - off);
+    const uint32_t a = ba + off;
+    const uint8_t header[] = {
+      S_CMD_O_WRITEN, // Opcode
+      clen & 0xFF, (clen >> 8) & 0xFF, (clen >> 16) & 0xFF, // 24-bit length, LE
+      a & 0xFF, (a >> 8) & 0xFF, (a >> 16) & 0xFF, // 24-bit addr, LE
+    };
+    const int64_t t = now_us();
+
+    ret = port_write(p, header, sizeof(header));
+    if (ret < 0)
+      return ret;
+    ret = command(p, buf + off, clen, NULL, 0, 0);
+    if (ret < 0)
+      return ret;
+
+    const int64_t e = now_us();
+    ret = command(p, &op, 1, NULL, 0, clen * WRITE_CYCLE_MS);
+    if (ret < 0)
+      return ret;
+    us[n] = now_us() - t;
+    wait += now_us() - e - 2 * 10 * 1000000LL / p->baud;
+  }
+
+  snprintf(what, sizeof(what), "write %d", chunk);
+  bench_report(what, us, n, MIN(len, n * chunk), now_us() - start);
+  print(INFO, "%-16s %9.2f ms waiting for the chip per exec\n", "", wait / 1000.0 / n);
+  return 0;
+}
+
+// Chip content is read first and written back as it is
+static int bench(port* p, const uint32_t ba, const uint32_t len, const uint32_t opbuf_len, const uint32_t page) {
+  static const uint32_t read_sizes[] = { 16, 256, 4096, 65536 };
+  static const uint32_t write_sizes[] = { 1, 16, 64, 256 };
+  const uint32_t wlen = MIN(len, BENCH_WRITE_LEN);
+  uint8_t* buf = malloc(wlen);
+  // Latency of each command of a test
+  uint32_t* us = malloc(BENCH_MAX_CMDS * sizeof(*us));
+  uint32_t errors;
+  int ret;
+
+  if (!buf || !us) {
+    print(ERROR, "Error allocating bench buffers\n");
+    exit(-1);
+  }
+
+  print(INFO, "Link at %d baud, %d bytes from %x\n", p->baud, len, ba);
+
+  ret = bench_echo(p, us);
+
+  for (size_t i = 0; ret == 0 && i < sizeof(read_sizes) / sizeof(*read_sizes); i++)
+    if (i == 0 || read_sizes[i - 1] < len)
+      ret = bench_read(p, us, ba, len, read_sizes[i]);
+
+  if (ret == 0)
+    ret = op_read(p, ba, wlen, sink_copy, buf);
+
+  for (size_t i = 0; ret == 0 && i < sizeof(write_sizes) / sizeof(*write_sizes); i++) {
+    const uint32_t chunk = write_sizes[i];
+
+    // Page mode chunks must not straddle pages
+    if (chunk + OPBUF_RECORD > opbuf_len || (page > 1 && chunk > page) || (i && write_sizes[i - 1] >= wlen))
+      continue;
+    ret = bench_write(p, us, buf, ba, wlen, chunk);
+  }
+
+  if (ret == 0)
+    ret = op_errorcnt(p, &errors);
+  if (ret == 0)
+    print(INFO, "Write errors: %d\n", errors);
+
+  free(us);
+  free(buf);
+  return ret;
+}
+
+// Image file formats, told by the extension
+typedef enum { IMAGE_RAW, IMAGE_IHEX, IMAGE_SREC } image_format;
+
+static image_format format_of(const char* filename) {
+  static const char* ihex[] = { ".hex", ".ihx", ".ihex" };
+  static const char* srec[] = { ".s19", ".s28", ".s37", ".srec", ".mot" };
+  const char* ext = strrchr(filename, '.');
+
+  if (!ext)
+    return IMAGE_RAW;
+  for (size_t i = 0; i < sizeof(ihex)/sizeof(*ihex); i++)
+    if (!strcasecmp(ext, ihex[i]))
+      return IMAGE_IHEX;
+  for (size_t i = 0; i < sizeof(srec)/sizeof(*srec); i++)
+    if (!strcasecmp(ext, srec[i]))
+      return IMAGE_SREC;
+  return IMAGE_RAW;
+}
+
+// Range of an image that the file populates, from the start of the image
+typedef struct _extent {
+  uint32_t off;
+  uint32_t len;
+} extent;
+
+// Where record data lands, as parse_records() goes
+typedef struct _records {
+  uint8_t* image;       // IMAGE_MAX bytes
+  uint32_t span;        // End of the highest data
+  extent* ext;          // Sorted and merged by load()
+  uint32_t next;
+  bool past;            // A record went past IMAGE_MAX
+} records;
+
+// The socket has 17 address lines: data past them can't be written
+#define IMAGE_MAX (1 << 17)
+
+static bool records_put(records* r, const uint32_t addr, const uint8_t* data, const uint32_t n) {
+  extent* last = r->next ? &r->ext[r->next - 1] : NULL;
+
+  if (!n)
+    return true;
+  if (addr >= IMAGE_MAX || n > IMAGE_MAX - addr) {
+    r->past = true;
+    return false;
+  }
+
+  memcpy(r->image + addr, data, n);
+  // Records mostly follow each other
+  if (last && last->off + last->len == addr) {
+    last->len += n;
+  } else {
+    if (r->next % 64 == 0) {
+      extent* ext = realloc(r->ext, (r->next + 64) * sizeof(extent));
+
+      if (!ext) {
+        print(ERROR, "Error allocating image ranges\n");
+        exit(-1);
+      }
+      r->ext = ext;
+    }
+    r->ext[r->next++] = (extent){ addr, n };
+  }
+  r->span = MAX(r->span, addr + n);
+  return true;
+}
+
+static int hex_nibble(const char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Go through the records of an Intel HEX or S-record file, line by line,
+// checksums included. Returns the line of the first bad record, 0 if all
+// are good.
+static int parse_records(const char* text, const uint32_t size, const image_format f, records* r) {
+  uint32_t base = 0;    // Intel HEX extended segment or linear address
+  int line = 0;
+
+  for (uint32_t pos = 0; pos < size; ) {
+    uint8_t b[1 + 255 + 1 + 4];   // Longest record, in bytes
+    uint32_t n = 0, addr = 0;
+    uint8_t type, sum = 0;
+    uint32_t eol = pos;
+    uint32_t i;
+
+    while (eol < size && text[eol] != '\n')
+      eol++;
+    line++;
+    // Blank lines, CR LF endings
+    i = pos;
+    pos = eol + 1;
+    while (eol > i && (text[eol - 1] == '\r' || text[eol - 1] == ' '))
+      eol--;
+    if (eol == i)
+      continue;
+
+    if (f == IMAGE_IHEX && text[i] != ':')
+      return line;
+    if (f == IMAGE_SREC && (text[i] != 'S' || eol - i < 2 || hex_nibble(text[i + 1]) < 0))
+      return line;
+    type = f == IMAGE_SREC ? hex_nibble(text[i + 1]) : 0;
+    i += f == IMAGE_SREC ? 2 : 1;
+
+    for (; i + 1 < eol && n < sizeof(b); i += 2) {
+      const int hi = hex_nibble(text[i]), lo = hex_nibble(text[i + 1]);
+
+      if (hi < 0 || lo < 0)
+        return line;
+      b[n] = hi << 4 | lo;
+      sum += b[n++];
+    }
+    if (i != eol || n < 1)
+      return line;
+
+    if (f == IMAGE_IHEX) {
+      // Count, address, type, data, checksum: all of it adds up to 0
+      if (n < 5 || n != b[0] + 5u || sum != 0)
+        return line;
+      type = b[3];
+      addr = (b[1] << 8 | b[2]);
+      if (type == 0x00 && !records_put(r, base + addr, b + 4, b[0]))
+        return line;
+      else if (type == 0x01)
+        break;
+      else if ((type == 0x02 || type == 0x04) && b[0] != 2)
+        return line;
+      else if (type == 0x02)
+        base = (b[4] << 8 | b[5]) << 4;
+      else if (type == 0x04)
+        base = (uint32_t)(b[4] << 8 | b[5]) << 16;
+      else if (type > 0x05)
+        return line;
+    } else {
+      // Count of what follows it, address, data, checksum: all of it but
+      // the type adds up to 0xFF
+      static const uint8_t addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+
+      if (type >= sizeof(addr_len))
+        return line;
+
+      const uint8_t alen = addr_len[type];
+
+      if (type == 4 || n < 1u + alen + 1 || n != b[0] + 1u || sum != 0xFF)
+        return line;
+      for (uint8_t k = 0; k < alen; k++)
+        addr = addr << 8 | b[1 + k];
+      if (type >= 1 && type <= 3 && !records_put(r, addr, b + 1 + alen, n - 2 - alen))
+        return line;
+      if (type >= 7)
+        break;
+    }
+  }
+
+  return 0;
+}
+
+static int extent_cmp(const void* a, const void* b) {
+  const extent* x = a;
+  const extent* y = b;
+
+  return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// Map the file instead of reading it: memory use doesn't depend on its size.
+// Intel HEX and S-record files are laid out in a single pass in an image of
+// IMAGE_MAX at most, 0xFF where they have no data, and ext lists the ranges
+// they populate. A raw binary is a single range.
+void load(const char* filename, uint8_t** buf, uint32_t* len, extent** ext, uint32_t* next) {
+  const image_format f = format_of(filename);
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  records r = { NULL, 0, NULL, 0, false };
+  uint8_t* text;
+  int bad;
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    print(ERROR, "Error opening file");
+    exit(-1);
+  }
+
+  if (st.st_size == 0) {
+    print(ERROR, "File %s is empty\n", filename);
+    exit(-1);
+  }
+
+  text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (text == MAP_FAILED) {
+    print(ERROR, "Error reading file");
+    exit(-1);
+  }
+  close(fd);
+
+  if (f == IMAGE_RAW) {
+    *buf = text;
+    *len = st.st_size;
+    *ext = malloc(sizeof(extent));
+    (*ext)[0] = (extent){ 0, *len };
+    *next = 1;
+    print(DEBUG, "Successfully opened file %s, %d byte long\n", filename, *len);
+    return;
+  }
+
+  r.image = mmap(NULL, IMAGE_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r.image == MAP_FAILED) {
+    print(ERROR, "Error allocating image");
+    exit(-1);
+  }
+  memset(r.image, 0xFF, IMAGE_MAX);
+
+  bad = parse_records((const char*)text, st.st_size, f, &r);
+  if (bad && r.past) {
+    print(ERROR, "%s:%d: data past %u KiB, the programmer can't reach it\n",
+          filename, bad, IMAGE_MAX / 1024);
+    exit(-1);
+  }
+  if (bad) {
+    print(ERROR, "%s:%d: bad record\n", filename, bad);
+    exit(-1);
+  }
+  if (r.span == 0) {
+    print(ERROR, "File %s has no data\n", filename);
+    exit(-1);
+  }
+  munmap(text, st.st_size);
+
+  // Give back the pages past the data
+  const uint32_t keep = (r.span + getpagesize() - 1) & ~(getpagesize() - 1);
+
+  if (keep < IMAGE_MAX)
+    munmap(r.image + keep, IMAGE_MAX - keep);
+
+  // Out of order or overlapping records
+  qsort(r.ext, r.next, sizeof(extent), extent_cmp);
+  *next = 0;
+  for (uint32_t i = 0; i < r.next; i++) {
+    extent* last = *next ? &r.ext[*next - 1] : NULL;
+
+    if (last && r.ext[i].off <= last->off + last->len)
+      last->len = MAX(last->len, r.ext[i].off + r.ext[i].len - last->off);
+    else
+      r.ext[(*next)++] = r.ext[i];
+  }
+
+  uint32_t data = 0;
+
+  for (uint32_t i = 0; i < *next; i++)
+    data += r.ext[i].len;
+  *buf = r.image;
+  *len = r.span;
+  *ext = r.ext;
+  print(INFO, "%s: %u bytes in %u ranges, up to %x\n", filename, data, *next, r.span - 1);
+}
+
+// Give up on link errors: the programmer is left in an unknown state
+#define CHECK(x) do { if ((ret = (x)) < 0) goto fail; } while (0)
+
+// Programmers driven at once, one thread each
+#define MAX_DEVICES 32
+// How often the programmer is checked while waiting for the next chip
+#define BATCH_POLL_MS 300
+
+// What to do with the chip, the same on every programmer
+typedef struct _task {
+  bool rd, wr, vr;
+  bool erase;
+  bool preunlock, postlock;
+  bool delta;
+  bool skip_blank;
+  bool verify_fast;
+  bool benchmark;
+  bool batch;
+  bool stats;
+  bool detect;
+  const char* chip;     // Profile name given with --chip
+  uint8_t passes;       // Samples per byte of a read, 0 for a plain read
+  bool vary_tacc;       // Later sample on each pass
+  int ba;               // Base address, -1 if not given
+  int len;              // Size given with --size, -1 if not given
+  uint32_t page;        // 0 if not given
+  uint8_t baud;
+  const uint8_t* wbuf;  // Image to write or verify, shared read-only
+  uint32_t wlen;
+  const extent* ext;    // Ranges of wbuf the file populates, in order
+  uint32_t next;
+  const char* rfile;
+} task;
+
+typedef struct _job {
+  const task* t;
+  const char* device;
+  pthread_t thread;
+  int ret;              // Link error, 0 if the programmer went through the task
+  int err;              // errno of the thread, for E_IO
+  bool failed;          // Chip did not blank check or verify
+  uint32_t errors;      // Write errors counted by the programmer
+  int64_t ms;
+} job;
+
+// Programmer as set up by handshake()
+typedef struct _session {
+  port serial;
+  uint32_t opbuf_len;
+  uint32_t serbuf_len;
+  uint32_t page;        // Page size the programmer accepted
+  chip chip;            // Profile in use, size 0 if none
+} session;
+
+// Find out which chip is in the socket, from its software ID or the name
+// given with --chip, and have the programmer use its timings. Its page size
+// is used unless --page was given.
+static int identify(session* s, const task* t) {
+  chip c;
+  uint8_t mfr, dev, i;
+  int ret;
+
+  if (!has_cmd(&s->serial, S_CMD_Q_CHIP) ||
+      !has_cmd(&s->serial, t->chip ? S_CMD_S_CHIP : S_CMD_Q_CHIPID)) {
+    print(WARNING, "Programmer has no chip profiles, ignoring %s\n", t->chip ? "--chip" : "--detect");
+    return 0;
+  }
+
+  if (t->chip) {
+    for (i = 0; ; i++) {
+      ret = op_chip(&s->serial, i, &c);
+      if (ret == E_NAK) {
+        char known[512] = "";
+
+        for (uint8_t k = 0; k < i && op_chip(&s->serial, k, &c) == 0; k++)
+          snprintf(known + strlen(known), sizeof(known) - strlen(known), " %s", c.name);
+        print(ERROR, "Unknown chip %s, the programmer knows:%s\n", t->chip, known);
+        return ret;
+      }
+      if (ret < 0)
+        return ret;
+      if (!strcasecmp(c.name, t->chip))
+        break;
+    }
+    CHECK(op_set_chip(&s->serial, i));
+  } else {
+    CHECK(op_chipid(&s->serial, &mfr, &dev, &i));
+    if (!mfr && !dev) {
+      print(WARNING, "Chip has no software ID, name it with --chip\n");
+      return 0;
+    }
+    if (i == S_CHIP_NONE) {
+      print(WARNING, "Unknown chip, ID %02X %02X\n", mfr, dev);
+      return 0;
+    }
+    CHECK(op_chip(&s->serial, i, &c));
+  }
+
+  char sector[32] = "", page[32] = "read only", twc[64] = "";
+
+  if (c.sector)
+    snprintf(sector, sizeof(sector), ", %u KiB sectors", c.sector / 1024);
+  if (c.page == 1)
+    snprintf(page, sizeof(page), "byte writes");
+  else if (c.page > 1)
+    snprintf(page, sizeof(page), "%u byte pages", c.page);
+  if (c.flags & CHIP_NOR)
+    snprintf(twc, sizeof(twc), ", tBP %u us, tSE %u ms, tCE %u ms", c.twc_us, c.tse_ms, c.tce_ms);
+  else if (c.flags & CHIP_ERASE)
+    snprintf(twc, sizeof(twc), ", tWC %u us, tCE %u ms", c.twc_us, c.tce_ms);
+  else if (c.page)
+    snprintf(twc, sizeof(twc), ", tWC %u us", c.twc_us);
+  print(INFO, "Chip %s: %u KiB%s, %s, tACC %u ns%s%s\n", c.name, c.size / 1024,
+        sector, page, c.tacc_ns, twc, c.flags & CHIP_SDP ? ", SDP" : "");
+
+  if (c.page == 0 && (t->wr || t->erase)) {
+    print(ERROR, "%s can't be written here\n", c.name);
+    return E_NAK;
+  }
+  if (!(c.flags & CHIP_SDP) && (t->preunlock || t->postlock))
+    print(WARNING, "%s has no software data protection\n", c.name);
+  if ((c.flags & CHIP_NOR) && (t->wr || t->erase) && !has_cmd(&s->serial, S_CMD_S_ERASE)) {
+    print(ERROR, "%s needs its erase commands, the programmer has none\n", c.name);
+    return E_NAK;
+  }
+  if ((c.flags & CHIP_NOR) && t->delta) {
+    print(ERROR, "%s is erased by sectors, it can't take --delta\n", c.name);
+    return E_NAK;
+  }
+  if (!t->page && c.page > 1)
+    s->page = c.page;
+  // Bytes of the page that are not loaded get erased
+  if ((c.flags & CHIP_SECTOR_WRITE) && t->wr && t->ba >= 0 &&
+      (t->ba % c.page || t->wlen % c.page))
+    print(WARNING, "%s rewrites whole pages: the image should start and end on a %u byte boundary\n",
+          c.name, c.page);
+  s->chip = c;
+
+  return 0;
+
+fail:
+  return ret;
+}
+
+// Power the socket and set the programmer up for the chip in it. Powering up
+// drops the chip profile and the page size.
+static int chip_up(session* s, const task* t) {
+  int ret;
+
+  CHECK(op_pin_state(&s->serial, true));
+
+  s->page = t->page ? t->page : 1;
+  memset(&s->chip, 0, sizeof(s->chip));
+  if (t->detect || t->chip)
+    CHECK(identify(s, t));
+
+  if (s->page > 1) {
+    ret = has_cmd(&s->serial, S_CMD_S_PAGESIZE) ? op_pagesize(&s->serial, s->page) : E_NAK;
+    if (ret < 0 && ret != E_NAK)
+      goto fail;
+    if (ret == E_NAK) {
+      print(ERROR, "Page size %d not supported, using byte mode\n", s->page);
+      s->page = 1;
     }
   }
-  printf("\n");
-}
 
-void printHex(char* p, int n) {
-  for (int i = 0; i < n; ++i) {
-    printf("%2X ", p[i] & 0xff);
-  }
-  printf("\n");
+  return 0;
+
+fail:
+  return ret;
 }
 
-typedef enum _log_level {
-  FATAL,
-  ERROR,
-  WARNING,
-  INFO,
-  DEBUG
-} log_level;
+// Get to know the programmer and set the link up as the task asks
+static int handshake(session* s, const task* t) {
+  uint32_t errors;
+  int ret;
 
-log_level g_log_level = INFO;
+  // Fetch board name
+  CHECK(op_pgmname(&s->serial));
 
-void print(log_level l, const char* fmt, ...) {
-  if (g_log_level < l)
-    return;
-  
-  va_list ap;
-  va_start(ap, fmt);
-  switch(l){
-    case DEBUG:
-      printf("[DEBUG  ] ");
-      break;
-    case INFO:
-      printf("[INFO   ] ");
-      break;
-    case WARNING:
-      printf("[WARNING] ");
-      break;
-    case ERROR:
-      printf("[ERROR  ] ");
-      break;
-    case FATAL:
-      printf("[FATAL  ] ");
-      break;
+  // Commands outside the base serprog set are used only when listed here
+  CHECK(op_cmdmap(&s->serial, s->serial.cmdmap));
+
+  if (t->baud != DEFAULT_BAUD) {
+    ret = has_cmd(&s->serial, S_CMD_S_BAUD) ? op_baud(&s->serial, t->baud, DEFAULT_BAUD) : E_NAK;
+    if (ret == E_NAK)
+      print(WARNING, "Could not switch to %d baud, staying at %d\n",
+            baudrates[t->baud].rate, baudrates[DEFAULT_BAUD].rate);
+    else if (ret < 0)
+      goto fail;
   }
-  vprintf(fmt, ap);
-  va_end(ap);
-}
 
-void timed_read(int fd, uint8_t* data, const uint32_t len) {
-  int proc = 0;
-  int tlen = len + 1; // ACK +  buffer
-  uint8_t *buf = malloc(len+1);
-  
-  do {
-    int ret;
-    
-    // Read must return after a certain timeout. See termios.
-    ret = read(fd, buf + proc, tlen - proc);
+  // Fetch opbuf size
+  CHECK(op_opbuf_len(&s->serial, &s->opbuf_len));
 
-    if (ret <= 0) {
-      free(buf);
-      longjmp(err, ret == 0 ? 1 : ret);
-    }
+  // Fetch serial buffer size
+  CHECK(op_serbuf_len(&s->serial, &s->serbuf_len));
 
-    proc += ret;
-  } while (proc < tlen);
+  if (g_compress) {
+    s->serial.rle_read = has_cmd(&s->serial, S_CMD_R_NBYTES_RLE);
+    if (!s->serial.rle_read)
+      print(WARNING, "Programmer can't compress reads\n");
+    s->serial.rle_write = has_cmd(&s->serial, S_CMD_O_WRITEN_RLE);
+    if (!s->serial.rle_write)
+      print(WARNING, "Programmer can't compress writes\n");
+  }
 
-  tcflush(fd, TCIOFLUSH);
+  CHECK(op_errorcnt_reset(&s->serial));
+  CHECK(op_errorcnt(&s->serial, &errors));
+  print(INFO, "Write errors: %d\n", errors);
 
-  print(DEBUG, "Read %d bytes\n", proc);
+  // A batch may have left the socket powered down
+  CHECK(chip_up(s, t));
 
-  if (buf[0] == S_ACK)
-    print(DEBUG, "ACK\n");
-  else if (buf[0] == S_NAK)
-    print(DEBUG, "NAK\n");
-  else
-    print(DEBUG, "WTF: %x\n", buf[0]);
+  return 0;
 
-  // Remove ack
-  memcpy(data, buf+1, len);
-  free(buf);
+fail:
+  return ret;
 }
 
-void op_pgmname(int fd) {
+// Erase flash from ba for len bytes: the whole chip if that covers it,
+// otherwise the sectors it touches. A blank check tells how it went.
+static int nor_erase(session* s, const uint32_t ba, const uint32_t len) {
+  const chip* c = &s->chip;
+  bool done = true;
   int ret;
-  uint8_t op = S_CMD_Q_PGMNAME;
-  char pgmname[16];
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
+  if (ba == 0 && len >= c->size) {
+    print(INFO, "Erasing chip...\n");
+    CHECK(op_erase(&s->serial, S_ERASE_CHIP, 0, c->tce_ms * 2, &done));
+  } else {
+    const uint32_t first = ba / c->sector;
+    const uint32_t last = (ba + len - 1) / c->sector;
+
+    if (ba % c->sector || (ba + len) % c->sector)
+      print(WARNING, "Erasing whole sectors, from %x to %x\n",
+            first * c->sector, (last + 1) * c->sector - 1);
+    print(INFO, "Erasing %u sectors...\n", last - first + 1);
+    for (uint32_t i = first; i <= last && done; i++)
+      CHECK(op_erase(&s->serial, S_ERASE_SECTOR, i * c->sector, c->tse_ms * 2, &done));
+  }
+  if (!done)
+    print(ERROR, "Erase did not complete in time\n");
 
-  timed_read(fd, (uint8_t*)pgmname, sizeof(pgmname));
+  return 0;
 
-  print(INFO, "Successfully connected programmer %.*s\n", sizeof(pgmname), pgmname);
+fail:
+  return ret;
 }
 
-void op_opbuf_init(int fd) {
+// Erase, write, verify and lock the chip in the socket
+static int program(job* j, session* s) {
+  const task* t = j->t;
+  const uint32_t ba = t->ba < 0 ? 0 : t->ba;
+  int len = t->len;
+  int erased_len = 0;   // Bytes from ba blank checked in this run
+  const bool nor = s->chip.flags & CHIP_NOR;
+  bool vr = t->vr;
   int ret;
-  uint8_t op = S_CMD_O_INIT;
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
+  if (t->erase) {
+    uint8_t blank[READ_CHUNK];
+    compare cmp = { NULL, 0, 0 };
+    writer w;
+    bool erased = false;  // Chip erase went through, already blank checked
+
+    memset(blank, 0xFF, sizeof(blank));
+
+    // The chip erase sequence lands on 0x5555 and 0x2AAA as data on parts
+    // that don't have it: only when the whole chip goes. Without the command
+    // the chip is erased by writing 0xFF.
+    if (!nor && (s->chip.flags & CHIP_ERASE) && has_cmd(&s->serial, S_CMD_S_ERASE) &&
+        ba == 0 && len >= (int)s->chip.size) {
+      uint32_t dirty;
+      bool done;
+
+      print(INFO, "Erasing chip...\n");
+      CHECK(op_erase(&s->serial, S_ERASE_CHIP, 0, s->chip.tce_ms * 2, &done));
+      CHECK(op_blank(&s->serial, ba, len, &dirty));
+      if (dirty == 0)
+        erased = true;
+      else
+        print(WARNING, "%u bytes left after chip erase, %s may not have it\n", dirty, s->chip.name);
+    }
 
-  timed_read(fd, NULL, 0);
-}
+    if (nor) {
+      CHECK(nor_erase(s, ba, len));
+    } else if (!erased) {
+      print(INFO, "Erasing device...\n");
+      writer_init(&w, &s->serial, s->opbuf_len, s->serbuf_len, s->page);
+      for (int off = 0; off < len; off += sizeof(blank))
+        CHECK(writer_put(&w, blank, MIN((int)sizeof(blank), len - off), ba + off));
+      CHECK(writer_finish(&w));
+    }
 
-uint16_t op_opbuf_len(int fd) {
-  int ret;
-  uint8_t op = S_CMD_Q_OPBUF;
-  uint16_t opbuf_len;
+    if (!erased) {
+      print(INFO, "Blank checking...\n");
+      CHECK(op_read(&s->serial, ba, len, sink_compare, &cmp));
+    }
+    if (cmp.bad == 0) {
+      print(INFO, "Erased successfully\n", len);
+      erased_len = len;
+    } else {
+      print(ERROR, "EEPROM is not blank\n", len);
+      j->failed = true;
+    }
+  }
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
+  if (t->preunlock) {
+    print(INFO, "Unlocking memory...\n");
+    CHECK(op_opbuf_sdp(&s->serial, false));
+    CHECK(op_opbuf_exec(&s->serial, SDP_MS));
+  }
 
-  timed_read(fd, (uint8_t*)&opbuf_len, sizeof(opbuf_len));
+  // Flash can only clear bits: what is not blank gets erased first. All of
+  // it before any write, ranges of the image may share a sector.
+  if (t->wr && nor) {
+    for (const extent* e = t->ext; e < t->ext + t->next; e++) {
+      uint32_t dirty;
+
+      if (e->off + e->len <= (uint32_t)erased_len)
+        continue;
+      CHECK(op_blank(&s->serial, ba + e->off, e->len, &dirty));
+      if (dirty)
+        CHECK(nor_erase(s, ba + e->off, e->len));
+    }
+  }
 
-  print(DEBUG, "Opbuf len is %d\n", opbuf_len);
-  return opbuf_len;
-}
+  // If write request, do it, range by range of the image
+  for (const extent* e = t->ext; t->wr && e < t->ext + t->next; e++) {
+    const uint8_t* wbuf = t->wbuf + e->off;
+    const uint32_t eba = ba + e->off;
+    bool blank = nor || e->off + e->len <= (uint32_t)erased_len;
+
+    if (t->delta) {
+      ret = delta_write(&s->serial, wbuf, e->len, eba, s->opbuf_len, s->serbuf_len, s->page, vr);
+      if (ret == E_VERIFY)
+        j->failed = true;
+      else if (ret < 0)
+        goto fail;
+      continue;
+    }
+    if (t->skip_blank && !blank) {
+      uint32_t dirty;
 
-uint16_t op_serbuf_len(int fd) {
-  int ret;
-  uint8_t op = S_CMD_Q_SERBUF;
-  uint16_t serbuf_len;
+      CHECK(op_blank(&s->serial, eba, e->len, &dirty));
+      if (dirty == 0)
+        blank = true;
+      else
+        print(WARNING, "EEPROM is not blank (%d bytes), writing all chunks\n", dirty);
+    }
+    CHECK(buffer_write(&s->serial, wbuf, e->len, eba, s->opbuf_len, s->serbuf_len, s->page,
+                       (t->skip_blank || nor) && blank));
+  }
+  // Touched pages are already verified
+  if (t->wr && t->delta)
+    vr = false;
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
+  bool verify_fast = vr && t->verify_fast;
+  if (verify_fast && !has_cmd(&s->serial, S_CMD_Q_CRC32)) {
+    print(WARNING, "Programmer can't compute CRC-32, reading back to verify\n");
+    verify_fast = false;
+  }
 
-  timed_read(fd, (uint8_t*)&serbuf_len, sizeof(serbuf_len));
+  // If read request, do it (read or verify)
+  if (verify_fast) {
+    bool bad = false;
 
-  print(DEBUG, "Serbuf len is %d\n", serbuf_len);
-  return serbuf_len;
-}
+    for (const extent* e = t->ext; e < t->ext + t->next; e++) {
+      ret = fast_verify(&s->serial, t->wbuf + e->off, e->len, ba + e->off);
+      if (ret == E_VERIFY)
+        bad = true;
+      else if (ret < 0)
+        goto fail;
+    }
+    if (!bad)
+      print(INFO, "Verified successfully\n");
+    else {
+      print(ERROR, "Failed verification\n");
+      j->failed = true;
+    }
+  } else if (vr) {
+    compare all = { NULL, 0, 0 };
 
-void op_opbuf_write(int fd, const uint32_t ba, const uint8_t* buf, const uint32_t len) {
-  int ret;
-  const uint8_t header[] = {
-    S_CMD_O_WRITEN, // Opcode
-    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
-    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
-  };
+    print(INFO, "Beginning read\n");
+    for (const extent* e = t->ext; e < t->ext + t->next; e++) {
+      compare cmp = { t->wbuf + e->off, 0, 0 };
 
-  ret = write(fd, header, sizeof(header));
-  if (ret < 0)
-    longjmp(err, ret);
-  
-  ret = write(fd, buf, len);
-  if (ret < 0)
-    longjmp(err, ret);
+      CHECK(op_read(&s->serial, ba + e->off, e->len, sink_compare, &cmp));
+      if (cmp.bad && !all.bad)
+        all.first = e->off + cmp.first;
+      all.bad += cmp.bad;
+    }
+    if (all.bad == 0)
+      print(INFO, "Verified successfully\n");
+    else {
+      print(ERROR, "Failed verification, %d bytes differ from %x\n", all.bad, ba + all.first);
+      j->failed = true;
+    }
+  } else if (t->rd) {
+    if (t->passes && !has_cmd(&s->serial, S_CMD_R_NBYTES_VOTE)) {
+      print(ERROR, "Programmer can't do multi-pass reads\n");
+      ret = E_NAK;
+      goto fail;
+    }
 
-  timed_read(fd, NULL, 0);
-}
+    FILE *fp = fopen(t->rfile, "wb");
 
-void op_opbuf_sdp(int fd, bool enable) {
-  int ret;
-  uint8_t op = S_CMD_O_RESET_SDP;
+    if (fp == NULL) {
+      print(ERROR, "Error opening file");
+      exit(-1);
+    }
+    print(INFO, "Beginning read\n");
+    if (t->passes) {
+      static unstable u;
+
+      memset(&u, 0, sizeof(u));
+      ret = op_read_vote(&s->serial, ba, len, t->passes | (t->vary_tacc ? S_VOTE_VARY_TACC : 0),
+                         sink_file, fp, &u);
+      if (ret == 0)
+        report_unstable(&u, t->passes);
+    } else {
+      ret = op_read(&s->serial, ba, len, sink_file, fp);
+    }
+    fclose(fp);
+    if (ret < 0)
+      goto fail;
+  }
+  if (t->postlock) {
+    print(INFO, "Locking memory...\n");
+    CHECK(op_opbuf_sdp(&s->serial, true));
+    CHECK(op_opbuf_exec(&s->serial, SDP_MS));
+  }
 
-  if (enable)
-    op = S_CMD_O_SET_SDP;
+  if (t->wr || t->erase)
+    CHECK(op_errorcnt(&s->serial, &j->errors));
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
-    
-  timed_read(fd, NULL, 0);
+  return 0;
+
+fail:
+  return ret;
 }
 
-void op_opbuf_exec(int fd) {
+// Wait for the operator to swap the chip: Enter on the terminal, or SW1.
+// The button resets the programmer, which is seen as it going silent: once
+// it is back it has to be set up again.
+// Returns 1 for the next chip, 0 to stop.
+static int wait_chip(session* s, const task* t) {
+  const uint8_t op = S_CMD_NOP;
+  char line[64];
   int ret;
-  const uint8_t op = S_CMD_O_EXEC;
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
-    
-  timed_read(fd, NULL, 0);
-}
+  print(INFO, "Swap the chip, then press SW1 or Enter (q to stop)\n");
+  while (1) {
+    struct pollfd pfd = { .fd = STDIN, .events = POLLIN };
+
+    ret = poll(&pfd, 1, BATCH_POLL_MS);
+    if (ret < 0 && errno != EINTR)
+      return E_IO;
+    if (ret > 0) {
+      ret = read(STDIN, line, sizeof(line));
+      if (ret <= 0 || line[0] == 'q')
+        return 0;
+      ret = chip_up(s, t);
+      return ret < 0 ? ret : 1;
+    }
 
-void op_read(int fd, const uint32_t ba, uint8_t* buf, const uint32_t len) {
-  int ret;
-  const uint8_t header[] = {
-    S_CMD_R_NBYTES, // Opcode
-    ba & 0xFF, (ba >> 8) & 0xFF, (ba >> 16) & 0xFF, // 24-bit addr, LE
-    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, // 24-bit length, LE
-  };
+    ret = command(&s->serial, &op, 1, NULL, 0, 0);
+    if (ret == E_IO)
+      return ret;
+    if (ret < 0)
+      break;
+  }
 
-  ret = write(fd, header, sizeof(header));
+  print(INFO, "Programmer reset, waiting for it...\n");
+  do {
+    // Bootloader first, then the firmware at the default speed
+    usleep(BATCH_POLL_MS * 1000);
+    ret = port_set_baud(&s->serial, DEFAULT_BAUD);
+    if (ret < 0)
+      return ret;
+    port_drain(&s->serial);
+    ret = op_syncnop(&s->serial);
+  } while (ret == E_TIMEOUT || ret == E_PROTO);
   if (ret < 0)
-    longjmp(err, ret);
+    return ret;
 
-  print(INFO, "Beginning read\n");
-
-  timed_read(fd, buf, len);
+  ret = handshake(s, t);
+  return ret < 0 ? ret : 1;
 }
 
-void op_errorcnt_reset(int fd) {
+// Program chip after chip over the same connection. The socket is powered
+// only while a chip is in the works.
+static int batch(job* j, session* s) {
+  uint32_t chips = 0, good = 0, errors = 0;
+  int64_t total_ms = 0;
   int ret;
-  const uint8_t op = S_CMD_S_ERRORCNT_RESET;
 
-  ret = write(fd, &op, 1);
-  if (ret < 0)
-    longjmp(err, ret);
-    
-  timed_read(fd, NULL, 0);
+  do {
+    const int64_t start = now_ms();
+
+    print(INFO, "Chip %u\n", chips + 1);
+    j->failed = false;
+    j->errors = 0;
+    // Powered and set up by the handshake, then by wait_chip()
+    CHECK(op_errorcnt_reset(&s->serial));
+    CHECK(program(j, s));
+    CHECK(op_pin_state(&s->serial, false));
+
+    const int64_t ms = now_ms() - start;
+    chips++;
+    good += !j->failed;
+    errors += j->errors;
+    total_ms += ms;
+    print(j->failed ? ERROR : INFO, "Chip %u: %s, %u write errors, %.1f s\n",
+          chips, j->failed ? "failed" : "ok", j->errors, ms / 1000.0);
+
+    ret = wait_chip(s, j->t);
+  } while (ret > 0);
+
+  print(INFO, "%u chips, %u ok, %u write errors, %.1f s per chip\n",
+        chips, good, errors, total_ms / 1000.0 / chips);
+  j->failed = good < chips;
+  j->errors = errors;
+  return ret;
+
+fail:
+  // The chip is about to be pulled: don't leave it powered
+  op_pin_state(&s->serial, false);
+  return ret;
+}
+
+// Where the time of a job went, as the programmer saw it: chip busy most of
+// the time means chip-bound, a full RX ring buffer-bound, otherwise the link
+// is the limit
+static void perf_report(const perf* c, const int64_t ms, const uint32_t serbuf_len) {
+  const double read_ms = c->read_ticks * PERF_TICK_US / 1000;
+  const double write_ms = c->write_ticks * PERF_TICK_US / 1000;
+
+  print(INFO, "Read %u bytes in %.1f ms of read cycles\n", c->bytes_read, read_ms);
+  print(INFO, "Wrote %u bytes in %.1f ms of page loads and polling, %u polls (longest %u)\n",
+        c->bytes_written, write_ms, c->poll_total, c->poll_max);
+  print(INFO, "RX ring peaked at %u of %u bytes, %u bytes lost, TX stalled %u times\n",
+        c->rx_high, serbuf_len, c->rx_overruns, c->tx_stalls);
+  if (ms > 0)
+    print(INFO, "Chip busy %.0f%% of %.1f s\n", (read_ms + write_ms) * 100 / ms, ms / 1000.0);
+  // Since power-up: the stack grows down towards the buffers
+  if (c->stack_unused != 0xFFFF)
+    print(c->stack_unused < STACK_MARGIN ? WARNING : INFO,
+          "Stack came within %u bytes of the buffers\n", c->stack_unused);
 }
 
-uint32_t op_errorcnt(int fd) {
+// Run the task on one programmer
+static int run(job* j) {
+  const task* t = j->t;
+  int64_t start = 0;
+  session s;
+  perf c;
   int ret;
-  const uint8_t op = S_CMD_Q_ERRORCNT;
-  uint32_t errors_cnt;
 
-  ret = write(fd, &op, 1);
+  ret = port_open(&s.serial, j->device);
   if (ret < 0)
-    longjmp(err, ret);
-
-  timed_read(fd, (uint8_t*)&errors_cnt, sizeof(errors_cnt));
-
-  return errors_cnt;
-}
-
-static void buffer_write(int fd, const uint8_t *wbuf, const int len, const int ba, const uint32_t opbuf_len) {
-  // const uint32_t chunk = 64 + 7;
-  uint32_t avspace = opbuf_len;
-  uint32_t off = 0;
+    goto fail;
+
+  CHECK(handshake(&s, t));
+
+  if (t->stats) {
+    ret = has_cmd(&s.serial, S_CMD_Q_PERF) ? op_perf(&s.serial, &c, true) : E_NAK;
+    if (ret == E_NAK)
+      print(WARNING, "Programmer has no performance counters\n");
+    else if (ret < 0)
+      goto fail;
+    else
+      start = now_ms();
+  }
 
-  // Split this request in multiple ones to fit opbuf and to avoid
-  // uart congestion
-  while(off < (uint32_t)len) {
-    // uint32_t plen = MIN(MIN(len-off, chunk), avspace - 7);
-    const uint32_t plen = MIN(64, (len-off));
-    
-    print(DEBUG, "Im' writing size %d at addr %x\n", plen, ba+off);
-    op_opbuf_write(fd, ba + off, wbuf + off, plen);
+  if (t->benchmark)
+    CHECK(bench(&s.serial, t->ba < 0 ? 0 : t->ba, t->len < 0 ? 4096 : t->len, s.opbuf_len, s.page));
+  else if (t->batch)
+    CHECK(batch(j, &s));
+  else
+    CHECK(program(j, &s));
 
-    off += plen;
-    avspace -= (plen + 7);
+  if (t->stats && start) {
+    const int64_t ms = now_ms() - start;
 
-    // No more space available in opbuf, time to commit
-    // if (avspace < (7 + plen)) {
-    op_opbuf_exec(fd);
-    print(DEBUG, "Committed opbuf\n");
-    avspace = opbuf_len;
-    // }
+    CHECK(op_perf(&s.serial, &c, false));
+    perf_report(&c, ms, s.serbuf_len);
   }
 
-  if (avspace != opbuf_len) {
-    op_opbuf_exec(fd);
-    print(DEBUG, "Committed opbuf\n");
-    avspace = opbuf_len;
-  }
+  return 0;
 
-  print(INFO, "Write errors: %d\n", op_errorcnt(fd));
+fail:
+  print(FATAL, "Serial port: %s\n", port_strerror(ret));
+  return ret;
 }
 
-void load(const char* filename, uint8_t** buf, uint32_t* len) {
-  struct stat st;
-  stat(filename, &st);
-  *len = st.st_size;
-
-  *buf = malloc(*len);
-
-  FILE *fp = fopen(filename, "rb");
-  // TODO handle failures
-  if (fp != NULL) {
-    fread(*buf, sizeof(char), *len, fp);
-    if (ferror(fp) != 0) {
-      print(ERROR, "Error reading file");
-      exit(-1);
-    }
-  } else {
-    print(ERROR, "Error opening file");
-    exit(-1);
-  }
+static void* run_thread(void* arg) {
+  job* j = arg;
+  const int64_t start = now_ms();
 
-  print(DEBUG, "Successfully opened file %s, %d byte long\n", filename, *len);
-  
-  fclose(fp);
-}
+  g_tag = j->device;
+  j->ret = run(j);
+  j->err = errno;
+  j->ms = now_ms() - start;
 
-void save(const char* filename, const uint8_t* buf, const uint32_t len) {
-  FILE *fp = fopen(filename, "wb");
-  // TODO handle failures
-  if (fp != NULL) {
-    fwrite(buf, sizeof(char), len, fp);
-    if (ferror(fp) != 0) {
-      print(ERROR, "Error writing file");
-      exit(-1);
-    }
-  } else {
-    print(ERROR, "Error opening file");
-    exit(-1);
-  }
-  fclose(fp);
+  return NULL;
 }
 
 // write, Read, verify
@@ -387,15 +2485,29 @@ int main(int argc, char* argv[]) {
   bool rd = false, wr = false, vr = false;
   bool erase = false;
   bool preunlock = false, postlock = false;
-
-  char* serial_port = NULL;
-
-  uint8_t *wbuf = NULL, *rbuf = NULL;
+  bool delta = false;
+  bool skip_blank = false;
+  bool verify_fast = false;
+  bool benchmark = false;
+  bool batch_mode = false;
+  bool stats = false;
+  bool detect = false;
+  const char* chip_name = NULL;
+  int passes = 0;
+  bool vary_tacc = false;
+
+  const char* devices[MAX_DEVICES];
+  int ndevices = 0;
+
+  uint8_t *wbuf = NULL;
+  uint32_t wlen = 0;
+  extent* ext = NULL;
+  uint32_t next = 0;
   char *wfile = NULL, *rfile = NULL;
   int ba = -1;          // Base address
   int len = -1;         // Must fit at least 24-bit, serprog specification
-  uint32_t opbuf_len;
-  uint32_t serbuf_len;
+  uint32_t page = 0;    // Page size, 1 is byte mode, 0 if not given
+  uint8_t baud = DEFAULT_BAUD;
 
   bool skip_verify = false;
 
@@ -405,11 +2517,24 @@ int main(int argc, char* argv[]) {
       {"write",      required_argument, 0, 'w'},
       {"verify",     required_argument, 0, 'v'},
       {"noverify",   no_argument,       0, 'n'},
+      {"verify-fast", no_argument,      0, 'F'},
       {"erase",      no_argument,       0, 'e'},
       {"verbose",    optional_argument, 0, 'V'},
       {"size",       required_argument, 0, 's'},
       {"addr",       required_argument, 0, 'a'},
       {"device",     required_argument, 0, 'd'},
+      {"page",       required_argument, 0, 'p'},
+      {"baud",       required_argument, 0, 'b'},
+      {"delta",      no_argument,       0, 'D'},
+      {"compress",   no_argument,       0, 'z'},
+      {"skip-blank", no_argument,       0, 'B'},
+      {"bench",      no_argument,       0, 'T'},
+      {"batch",      no_argument,       0, 'M'},
+      {"stats",      no_argument,       0, 'S'},
+      {"detect",     no_argument,       0, 'I'},
+      {"chip",       required_argument, 0, 'C'},
+      {"multipass",  required_argument, 0, 'm'},
+      {"vary-tacc",  no_argument,       0, 'A'},
       {"unlock",     no_argument,       0, 'U'},
       {"lock",       no_argument,       0, 'P'},
       {"help",       no_argument,       0, 'h'},
@@ -420,11 +2545,24 @@ int main(int argc, char* argv[]) {
       "write the content of file in eeprom, then verify. Must specify addr",
       "verify the content of the file with the eeprom. Must specify addr",
       "skip verification after write",
-      "erase the eeprom (by software, i.e. write FF)",
+      "verify by comparing CRC-32 computed on the programmer",
+      "erase the eeprom (with its erase command if the chip is known, else write FF)",
       "set verbosity level to arg (0 low, 7 high)",
       "set reading size",
       "set starting address (deafult 0)",
-      "set serial device (deafult /dev/ttyUSB0)",
+      "set serial device (deafult /dev/ttyUSB0), repeat or separate with commas to program several at once",
+      "write in pages of arg bytes (e.g. 64 for 28C256)",
+      "set link speed (38400, 115200, 500000, 1000000, 2000000)",
+      "write only pages that differ from the eeprom content",
+      "compress data on the link",
+      "don't write 0xFF chunks if the eeprom is blank",
+      "measure link, read and write speed (rewrites size bytes from addr)",
+      "program chip after chip, swapped with the socket powered down",
+      "print the programmer counters after the job",
+      "identify the chip by its software ID and use its timings (writes 0x5555/0x2AAA of a 28C EEPROM, put back after: keep it powered)",
+      "use the timings of chip arg (e.g. 28C256)",
+      "read arg samples of each byte and keep the majority (odd, 3 to 15), list unstable bytes",
+      "with --multipass, present the address again for each sample and take sample n n*0.5us after it, earlier than tACC first",
       "unlock before",
       "lock after",
       "print this help"
@@ -432,7 +2570,7 @@ int main(int argc, char* argv[]) {
 
     // int this_option_optind = optind ? optind : 1;
     int option_index = 0;
-    int c = getopt_long(argc, argv, "r:w:v:neVs:a:d:UPh", long_options, &option_index);
+    int c = getopt_long(argc, argv, "r:w:v:nFeVs:a:d:p:b:DzBTMSIC:m:AUPh", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -456,6 +2594,10 @@ int main(int argc, char* argv[]) {
         skip_verify = true;
         break;
 
+      case 'F':
+        verify_fast = true;
+        break;
+
       case 'e':
         erase = true;
         break;
@@ -488,10 +2630,78 @@ int main(int argc, char* argv[]) {
       break;
 
       case 'd':
-        if (optarg && strlen(optarg))
-          serial_port = optarg;
+        if (!optarg)
+          break;
+
+        for (char* dev = strtok(optarg, ","); dev; dev = strtok(NULL, ",")) {
+          if (ndevices == MAX_DEVICES) {
+            print(FATAL, "Too many devices, at most %d\n", MAX_DEVICES);
+            exit(-1);
+          }
+          devices[ndevices++] = dev;
+        }
         break;
       
+      case 'p':
+        if (optarg)
+          page = atoi(optarg);
+        break;
+
+      case 'b':
+        if (!optarg)
+          break;
+
+        for (baud = 0; baud < sizeof(baudrates)/sizeof(*baudrates); baud++)
+          if (baudrates[baud].rate == atoi(optarg))
+            break;
+
+        if (baud == sizeof(baudrates)/sizeof(*baudrates)) {
+          print(FATAL, "Unsupported baud rate %s\n", optarg);
+          exit(-1);
+        }
+        break;
+
+      case 'D':
+        delta = true;
+        break;
+
+      case 'z':
+        g_compress = true;
+        break;
+
+      case 'B':
+        skip_blank = true;
+        break;
+
+      case 'T':
+        benchmark = true;
+        break;
+
+      case 'M':
+        batch_mode = true;
+        break;
+
+      case 'S':
+        stats = true;
+        break;
+
+      case 'I':
+        detect = true;
+        break;
+
+      case 'C':
+        chip_name = optarg;
+        break;
+
+      case 'm':
+        if (optarg)
+          passes = atoi(optarg);
+        break;
+
+      case 'A':
+        vary_tacc = true;
+        break;
+
       case 'U':
         preunlock = true;
         break;
@@ -547,12 +2757,41 @@ int main(int argc, char* argv[]) {
     exit(-1);
   }
   
+  // Record files carry their addresses, --addr moves them
+  if ((wr || vr) && ba < 0 && format_of(wfile) != IMAGE_RAW)
+    ba = 0;
+
   if ((rd || wr || vr) && ba < 0) {
     print(FATAL, "Invalid base address length\n");
     exit(-1);
   }
 
 
+  if (passes && (passes < 3 || passes > S_VOTE_PASSES || !(passes & 1))) {
+    print(FATAL, "Invalid number of passes, odd from 3 to %d\n", S_VOTE_PASSES);
+    exit(-1);
+  }
+
+  if (delta && !wr) {
+    print(FATAL, "--delta is for writes\n");
+    exit(-1);
+  }
+
+  if (passes && !rd) {
+    print(FATAL, "Multi-pass is for reads\n");
+    exit(-1);
+  }
+
+  if (vary_tacc && !passes) {
+    print(FATAL, "--vary-tacc goes with --multipass\n");
+    exit(-1);
+  }
+
+  if ((page & (page - 1)) || page > PAGE_MAX) {
+    print(FATAL, "Invalid page size\n");
+    exit(-1);
+  }
+
   if (skip_verify)
     vr = false;
   else if (wr)
@@ -574,99 +2813,87 @@ int main(int argc, char* argv[]) {
     fflush(stdin);
   }
 
-  int ecode = setjmp(err);
+  if (ndevices == 0)
+    devices[ndevices++] = DEFAULT_DEVICE;
 
-  if (ecode < 0) {
-    print(FATAL, "Serial port: %s\n", strerror(errno));
-    return ecode;
-  } else if (ecode > 0) {
-    print(FATAL, "Serial timeout\n");
-    return ecode;
+  if (ndevices > 1 && (rd || benchmark || batch_mode)) {
+    print(FATAL, "Read, bench and batch work on a single device\n");
+    return -1;
   }
-  else {
-    int fd = init_serial(serial_port != NULL ? serial_port : DEFAULT_DEVICE);
-
-    // Fetch board name
-    op_pgmname(fd);
-
-    // Fetch opbuf size
-    opbuf_len = op_opbuf_len(fd);
-
-    // Fetch serial buffer size
-    serbuf_len = op_serbuf_len(fd);
-    (void)serbuf_len;
-
-    op_errorcnt_reset(fd);
-    print(INFO, "Write errors: %d\n", op_errorcnt(fd));
-
-    if (erase) {
-      wbuf = malloc(len);
-      rbuf = malloc(len);
-
-      memset(wbuf, 0xFF, len);
-
-      print(INFO, "Erasing device...\n");
-      buffer_write(fd, wbuf, len, 0, opbuf_len);
-
-      print(INFO, "Blank checking...\n");
-      op_read(fd, ba, rbuf, len);
-
-      if (g_log_level >= DEBUG)
-        hexdump(rbuf, len);
-
-      if (0 == memcmp(wbuf, rbuf, len))
-        print(INFO, "Erased successfully\n", len);
-      else
-        print(ERROR, "EEPROM is not blank\n", len);
-
-      free(wbuf);
-      free(rbuf);
-      wbuf = rbuf = NULL;
-    }
 
-    if (wr || vr) {
-      load(wfile, &wbuf, (uint32_t*)&len);
-    }
+  if (batch_mode && (rd || benchmark)) {
+    print(FATAL, "Batch mode writes, verifies or erases\n");
+    return -1;
+  }
 
-    if (rd || vr)
-      rbuf = malloc(len);
-    
-    if (preunlock) {
-      print(INFO, "Unlocking memory...\n");
-      op_opbuf_sdp(fd, false);
-      op_opbuf_exec(fd);
-    }
+  // Every programmer writes from the same mapping
+  if (wr || vr)
+    load(wfile, &wbuf, &wlen, &ext, &next);
+
+  const task t = {
+    .rd = rd, .wr = wr, .vr = vr,
+    .erase = erase,
+    .preunlock = preunlock, .postlock = postlock,
+    .delta = delta,
+    .skip_blank = skip_blank,
+    .verify_fast = verify_fast,
+    .benchmark = benchmark,
+    .batch = batch_mode,
+    .stats = stats,
+    .detect = detect, .chip = chip_name,
+    .passes = passes, .vary_tacc = vary_tacc,
+    .ba = ba, .len = len,
+    .page = page,
+    .baud = baud,
+    .wbuf = wbuf, .wlen = wlen,
+    .ext = ext, .next = next,
+    .rfile = rfile,
+  };
+  static job jobs[MAX_DEVICES];
+  int ret = 0;
+
+  if (ndevices == 1) {
+    jobs[0] = (job){ .t = &t, .device = devices[0] };
+    ret = run(&jobs[0]);
+    // A failed verify is not a link error, the exit code tells it all the same
+    if (ret == 0 && jobs[0].failed)
+      ret = -1;
+  } else {
+    int done = 0;
+    uint32_t errors = 0;
 
-    // If write request, do it
-    if (wr) {
-      buffer_write(fd, wbuf, len, ba, opbuf_len);
+    for (int i = 0; i < ndevices; i++) {
+      jobs[i] = (job){ .t = &t, .device = devices[i] };
+      if (pthread_create(&jobs[i].thread, NULL, run_thread, &jobs[i]) != 0) {
+        print(FATAL, "Can't start a thread for %s\n", devices[i]);
+        exit(-1);
+      }
     }
 
-    // If read request, do it (read or verify)
-    if (rd || vr) {
-      op_read(fd, ba, rbuf, len);
+    for (int i = 0; i < ndevices; i++)
+      pthread_join(jobs[i].thread, NULL);
 
-      if (g_log_level >= DEBUG)
-        hexdump(rbuf, len);
+    for (int i = 0; i < ndevices; i++) {
+      const job* j = &jobs[i];
 
-      if (rd) save(rfile, rbuf, len);
-
-      if (vr) {
-        if (0 == memcmp(wbuf, rbuf, len))
-          print(INFO, "Verified successfully\n", len);
-        else
-          print(ERROR, "Failed verification\n", len);
+      errno = j->err;
+      if (j->ret < 0)
+        print(ERROR, "%s: %s after %.1f s\n", j->device, port_strerror(j->ret), j->ms / 1000.0);
+      else if (j->failed)
+        print(ERROR, "%s: failed, %u write errors, %.1f s\n", j->device, j->errors, j->ms / 1000.0);
+      else {
+        print(INFO, "%s: ok, %u write errors, %.1f s\n", j->device, j->errors, j->ms / 1000.0);
+        done++;
       }
+      errors += j->errors;
     }
-    if (postlock) {
-      print(INFO, "Locking memory...\n");
-      op_opbuf_sdp(fd, true);
-      op_opbuf_exec(fd);
-    }
+    print(INFO, "%d of %d devices done, %u write errors\n", done, ndevices, errors);
+    if (done < ndevices)
+      ret = -1;
   }
 
-  if (rbuf) free(rbuf);
-  if (wbuf) free(wbuf);
+  if (wbuf) munmap(wbuf, wlen);
+  free(ext);
 
-  return 0;
+  return ret;
 }
@@ -26,4 +26,24 @@
 #define S_CMD_O_RESET_SDP	0x19		/* Write to opbuf: reset SDP */
 #define S_CMD_O_SET_SDP		0x1A		/* Write to opbuf: set SDP */
 #define S_CMD_S_ERRORCNT_RESET		0x1B		/* Reset errors counter */
-#define S_CMD_Q_ERRORCNT		0x1C		/* Get number of writing errors */
\ No newline at end of file
+#define S_CMD_Q_ERRORCNT		0x1C		/* Get number of writing errors */
+#define S_CMD_S_PAGESIZE		0x1D		/* Set Write-N page size */
+#define S_CMD_S_BAUD		0x1E		/* Set serial link speed */
+#define S_BAUD_CONFIRM		0x55		/* Sent and echoed at the new speed */
+#define S_CMD_Q_BLANK		0x1F		/* Count non-blank bytes in a range */
+#define S_CMD_Q_CRC32		0x20		/* CRC-32 of a range */
+#define S_CMD_R_NBYTES_RLE	0x21		/* Read n bytes, RLE encoded stream */
+#define S_RLE_ESC		0xA5		/* RLE escape: S_RLE_ESC, count, byte */
+#define S_CMD_O_WRITEN_RLE	0x22		/* Write to opbuf: Write-N, RLE encoded payload */
+#define S_CMD_Q_PERF		0x23		/* Performance counters, arg: clear them after */
+#define S_CMD_Q_CHIPID		0x24		/* Software ID of the chip, uses its profile */
+#define S_CMD_Q_CHIP		0x25		/* Chip profile, arg: index */
+#define S_CMD_S_CHIP		0x26		/* Use a chip profile, arg: index */
+#define S_CHIP_NONE		0xFF		/* No profile: worst case timings */
+#define S_CMD_S_ERASE		0x27		/* Erase, args: what, 24-bit addr */
+#define S_ERASE_SECTOR		0x00		/* Sector holding addr */
+#define S_ERASE_CHIP		0x01		/* Whole chip */
+#define S_CMD_R_NBYTES_VOTE	0x28		/* Read n bytes, majority of samples, args: 24-bit addr, 24-bit len, mode */
+#define S_VOTE_PASSES		0x0F		/* Mode: samples per byte */
+#define S_VOTE_VARY_TACC	0x80		/* Mode: later sample on each pass */
+#define S_VOTE_LIST		16		/* Unstable offsets listed per read */